@@ -98,7 +98,7 @@ main(int argc, char **argv)
         sb.s_magic = SP_MAGIC;
         sb.s_mod = SP_FSCLEAN;
         sb.s_nifree = SP_MAXFILES - 6;  
-        sb.s_nbfree = SP_MAXBLOCKS - 6;
+        sb.s_nbfree = SP_DATA_BLOCKS - 6;
 
         /*
          * First 4 inodes are in use. Inodes 0 and 1 are not
@@ -115,16 +115,17 @@ main(int argc, char **argv)
 
         /*
          * The first two blocks are allocated for the entries
-         * for the root and lost+found directories. Others were 
-		 * marked FREE by memset above
+         * for the root and lost+found directories. The next four 
+         * hold file contents. Each is one bit in the block bitmap.
+         * Others were marked FREE by memset above
+         *
+         *   bit 0   - root directory entries
+         *   bit 1   - lost_found directory entries
+         *   bit 2   - contents for /hello
+         *   bits 3-5 - contents for /big-lorem-ipsum
          */
 
-        sb.s_block[0] = SP_BLOCK_INUSE; /* root directory entries */
-        sb.s_block[1] = SP_BLOCK_INUSE; /* lost_found directory entries */
-        sb.s_block[2] = SP_BLOCK_INUSE; /* contents for /hello */
-        sb.s_block[3] = SP_BLOCK_INUSE; /* contents for /big-lorem-ipsum */
-        sb.s_block[4] = SP_BLOCK_INUSE; /* contents for /big-lorem-ipsum */
-        sb.s_block[5] = SP_BLOCK_INUSE; /* contents for /big-lorem-ipsum */
+        sb.s_bmap[0] = 0x3f;
 
         write(devfd, (char *)&sb, sizeof(struct sp_superblock));
 
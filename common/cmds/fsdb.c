@@ -22,6 +22,7 @@
 
 struct sp_superblock       sb;
 int                        devfd;
+int                        bsize;
 
 void
 display_help()
@@ -31,12 +32,116 @@ display_help()
 	printf("s  - display superblock\n");
 	printf("si - display superblock inode list\n");
 	printf("sd - display superblock data block list\n");
+	printf("sf - display free space and file fragmentation\n");
 	printf("d  - display contents of directory block\n");
 	printf("b  - display block contents in ASCII where possible "
            "(e.g. \"b131\")\n");
 	printf("u  - undelete file (will prompt for inode)\n");
 }
 
+/*
+ * The superblock holds a bitmap of data blocks. "bno" is relative to 
+ * SP_FIRST_DATA_BLOCK so bit 0 is the first data block.
+ */
+
+int
+block_inuse(int bno)
+{
+	return (sb.s_bmap[bno / 32] >> (bno % 32)) & 1;
+}
+
+void
+set_block_inuse(int bno)
+{
+	sb.s_bmap[bno / 32] |= (1U << (bno % 32));
+}
+
+/*
+ * Expand an inode's block map into addr[] (SP_DIRECT_BLOCKS entries)
+ * whichever format it's stored in. Inodes with SP_INODE_EXTENTS set 
+ * hold a list of extents rather than one address per block.
+ */
+
+void
+get_map(struct sp_inode *spi, int *addr)
+{
+	struct sp_extent	*ext;
+	unsigned int		i;
+	int					n;
+
+	if (!(spi->i_flags & SP_INODE_EXTENTS)) {
+		memcpy(addr, spi->i_addr, SP_DIRECT_BLOCKS * sizeof(int));
+		return;
+	}
+	memset(addr, 0, SP_DIRECT_BLOCKS * sizeof(int));
+	for (n = 0 ; n < SP_MAX_EXTENTS && spi->i_extent[n].e_len ; n++) {
+		ext = &spi->i_extent[n];
+		for (i = 0 ; i < ext->e_len && ext->e_lblk + i < SP_DIRECT_BLOCKS ; i++) {
+			addr[ext->e_lblk + i] = ext->e_pblk + i;
+		}
+	}
+}
+
+/*
+ * Count the fragments in an inode's block map. Taking the mapped blocks
+ * in file order (skipping holes), a new fragment starts at every block 
+ * that isn't physically next to the one before it. After the direct
+ * blocks we carry on through the indirect block (depth 1) and the 
+ * double indirect block (depth 2). This matches what the kernel 
+ * reports for SPFS_IOC_FREESPACE.
+ */
+
+void
+add_fragment(int addr, int *prev, int *nfrags)
+{
+	int		blk = SP_ADDR_BLOCK(addr);
+
+	if (blk == 0) {
+		return;
+	}
+	if (blk != *prev + 1) {
+		(*nfrags)++;
+	}
+	*prev = blk;
+}
+
+void
+tree_fragments(int blk, int depth, int *prev, int *nfrags)
+{
+	int				*p;
+	unsigned int	i;
+
+	if (blk == 0) {
+		return;
+	}
+	p = malloc(bsize);
+	lseek(devfd, blk * bsize, SEEK_SET);
+	read(devfd, p, bsize);
+	for (i = 0 ; i < SP_ADDRS_PER_BLOCK(bsize) ; i++) {
+		if (depth > 1) {
+			tree_fragments(p[i], depth - 1, prev, nfrags);
+		} else {
+			add_fragment(p[i], prev, nfrags);
+		}
+	}
+	free(p);
+}
+
+int
+count_fragments(struct sp_inode *spi)
+{
+	int		addr[SP_DIRECT_BLOCKS];
+	int		i, prev = 0, nfrags = 0;
+
+	get_map(spi, addr);
+	for (i = 0 ; i < SP_DIRECT_BLOCKS ; i++) {
+		add_fragment(addr[i], &prev, &nfrags);
+	}
+	tree_fragments(spi->i_ind, 1, &prev, &nfrags);
+	tree_fragments(spi->i_dind, 2, &prev, &nfrags);
+	return nfrags;
+}
+
 /*
  * Read in an inode from disk. Inside lseek() we calculate the offset
  * within the device where the inode is located.
@@ -49,7 +154,7 @@ read_inode(ino_t inum, struct sp_inode *spi, int read_anyway)
 		printf("Inode is free\n");
 		return 0;
 	}
-	lseek(devfd, (SP_INODE_BLOCK * SP_BSIZE) + (inum * SP_BSIZE), SEEK_SET);
+	lseek(devfd, (SP_INODE_BLOCK * bsize) + (inum * bsize), SEEK_SET);
 	read(devfd, (char *)spi, sizeof(struct sp_inode));
 	return 1;
 }
@@ -69,11 +174,13 @@ int
 sp_diradd(struct sp_inode *spi, int inum)
 {
     struct sp_dirent    *dirent;
-	char				name[16], disk_blk[SP_BSIZE];
+	char				name[16], disk_blk[SP_MAX_BSIZE];
+    int                 addr[SP_DIRECT_BLOCKS];
     int                 blk = 0;
     int                 error =  0, i, pos;
 
 	sprintf(name, "%d", inum);
+	get_map(spi, addr);
 
     /*
      * i_blocks is the number of blocks allocated to lost+found. We loop
@@ -83,18 +190,18 @@ sp_diradd(struct sp_inode *spi, int inum)
      */
     
     for (blk=0 ; blk < spi->i_blocks ; blk++) {
-		lseek(devfd, spi->i_addr[blk] * SP_BSIZE, SEEK_SET);
-		read(devfd, disk_blk, SP_BSIZE);
+		lseek(devfd, addr[blk] * bsize, SEEK_SET);
+		read(devfd, disk_blk, bsize);
         dirent = (struct sp_dirent *)disk_blk;
-        for (i=0 ; i < SP_DIRS_PER_BLOCK ; i++) {
+        for (i=0 ; i < SP_DIRS_PER_BLOCK(bsize) ; i++) {
             if (dirent->d_ino != 0) {
                 dirent++;
                 continue;
             } else { /* we've found an empty slot */
                 dirent->d_ino = inum;
                 strcpy(dirent->d_name, name);
-                lseek(devfd, spi->i_addr[blk] * SP_BSIZE, SEEK_SET);
-				write(devfd, disk_blk, SP_BSIZE);
+                lseek(devfd, addr[blk] * bsize, SEEK_SET);
+				write(devfd, disk_blk, bsize);
                 return 0;
             }
         }
@@ -112,7 +219,8 @@ void
 undelete_file(void)
 {
 	struct sp_inode spi, lfip;
-	char			buf[16], inode_buf[SP_BSIZE];
+	char			buf[16], inode_buf[SP_MAX_BSIZE];
+	int				addr[SP_DIRECT_BLOCKS];
 	int				i, inum, error;
 
 	printf("inode num > ") ;
@@ -149,20 +257,22 @@ undelete_file(void)
 
 	/*
 	 * 4. For all blocks (i) listed in the inode (based on i_size)
-		  mark sb.s_block[i]) as inuse 
+		  mark the block as inuse in the superblock bitmap
 	 */
 
+	get_map(&spi, addr);
 	for (i = 0 ; i < spi.i_blocks ; i++) {
-		if (sb.s_block[spi.i_addr[i]] != SP_BLOCK_FREE) {
+		if (block_inuse(SP_ADDR_BLOCK(addr[i]) - SP_FIRST_DATA_BLOCK)) {
 			sb.s_inode[inum] = SP_INODE_FREE;
 	        sb.s_nifree++;
-			printf("Block %d in use so can't undelete inode\n", spi.i_addr[i]);
+			printf("Block %d in use so can't undelete inode\n", 
+				   SP_ADDR_BLOCK(addr[i]));
 			return;
 		}
 	}
 
 	for (i = 0 ; i < spi.i_blocks ; i++) {
-		sb.s_block[spi.i_addr[i]] = SP_BLOCK_INUSE;
+		set_block_inuse(SP_ADDR_BLOCK(addr[i]) - SP_FIRST_DATA_BLOCK);
 		sb.s_nbfree--;
 	}
 
@@ -173,7 +283,7 @@ undelete_file(void)
 	read_inode(3, &lfip, 0);
 	error = sp_diradd(&lfip, inum); /* XXX - can fail if no space available */
 	lfip.i_size += SP_DIRENT_SIZE;
-	lseek(devfd, (SP_INODE_BLOCK * SP_BSIZE) + (3 * SP_BSIZE), SEEK_SET);
+	lseek(devfd, (SP_INODE_BLOCK * bsize) + (3 * bsize), SEEK_SET);
     write(devfd, (char *)&lfip, sizeof(struct sp_inode));
 
 	/*
@@ -204,13 +314,13 @@ undelete_file(void)
 void
 print_directory_block(int blk)
 {
-	char	            buf[SP_BSIZE];
+	char	            buf[SP_MAX_BSIZE];
     struct sp_dirent    *dirent = (struct sp_dirent *)buf;
 	int		            x, y;
 
-	lseek(devfd, blk * SP_BSIZE, SEEK_SET);
-	read(devfd, buf, SP_BSIZE);
-	for (x = 0 ; x < (SP_BSIZE / sizeof(struct sp_dirent)); x++) {
+	lseek(devfd, blk * bsize, SEEK_SET);
+	read(devfd, buf, bsize);
+	for (x = 0 ; x < (bsize / sizeof(struct sp_dirent)); x++) {
         if (dirent->d_ino == 0) {
             continue; /* slot does not contain an inode */
         } else {
@@ -230,12 +340,12 @@ print_directory_block(int blk)
 void
 print_block(int blk)
 {
-	char	buf[SP_BSIZE];
+	char	buf[SP_MAX_BSIZE];
 	int		x, y;
 
-	lseek(devfd, blk * SP_BSIZE, SEEK_SET);
-	read(devfd, buf, SP_BSIZE);
-	for (x = 0 ; x < SP_BSIZE ; x += 16) {
+	lseek(devfd, blk * bsize, SEEK_SET);
+	read(devfd, buf, bsize);
+	for (x = 0 ; x < bsize ; x += 16) {
 		printf("%04x  ", x);
 		for (y = 0 ; y < 16 ; y += 2) {
 			printf("%02x%02x ", (int)(buf[x + y]), (int)(buf[x + y + 1]));
@@ -252,6 +362,60 @@ print_block(int blk)
 	}
 }
 
+/*
+ * Print a histogram of free extent sizes, the largest free extent and
+ * the number of fragments in each file. This is the same report as the
+ * SPFS_IOC_FREESPACE ioctl but taken from what's on disk.
+ */
+
+void
+print_freespace()
+{
+	struct sp_inode		inode;
+	int					hist[SP_FS_HIST] = { 0 };
+	int					i, b, run = 0, nfree = 0, nextents = 0, largest = 0;
+
+	for (i = 0 ; i <= SP_DATA_BLOCKS ; i++) {
+		if (i < SP_DATA_BLOCKS && !block_inuse(i)) {
+			nfree++;
+			run++;
+			continue;
+		}
+		if (run) {
+			for (b = 0 ; b < SP_FS_HIST - 1 && (run >> (b + 1)) ; b++) {
+				;
+			}
+			hist[b]++;
+			nextents++;
+			if (run > largest) {
+				largest = run;
+			}
+			run = 0;
+		}
+	}
+	printf("Free space: %d blocks in %d extents, largest %d blocks\n",
+		   nfree, nextents, largest);
+	for (b = 0 ; b < SP_FS_HIST ; b++) {
+		if (b == SP_FS_HIST - 1) {
+			printf("  %4d+      : %d\n", 1 << b, hist[b]);
+		} else {
+			printf("  %4d - %4d: %d\n", 1 << b, (1 << (b + 1)) - 1, hist[b]);
+		}
+	}
+	printf("File fragments:\n");
+	for (i = SP_ROOT_INO ; i < SP_MAXFILES ; i++) {
+		if (sb.s_inode[i] != SP_INODE_INUSE) {
+			continue;
+		}
+		read_inode(i, &inode, 0);
+		if (S_ISLNK(inode.i_mode)) {
+			continue;
+		}
+		printf("  inode %3d: %3d blocks in %d fragments\n", 
+			   i, inode.i_blocks, count_fragments(&inode));
+	}
+}
+
 /*
  * We are passed an inode (struct sp_inode) so simply display its contents. 
  * We will display blocks allocated and if it's a directory, we'll display 
@@ -261,8 +425,10 @@ print_block(int blk)
 void
 print_inode(int inum, struct sp_inode *spi)
 {
-	char                    buf[SP_BSIZE];
+	char                    buf[SP_MAX_BSIZE];
 	struct sp_dirent        *dirent;
+	struct sp_extent        *ext;
+	int                     addr[SP_DIRECT_BLOCKS];
 	int                     i, x, pi = 0;
 	time_t					tm;
 
@@ -279,14 +445,25 @@ print_inode(int inum, struct sp_inode *spi)
 	printf("  i_gid      = %d\n", spi->i_gid);
 	printf("  i_size     = %d\n", spi->i_size);
 	printf("  i_blocks   = %d\n", spi->i_blocks);
-    if (spi->i_blocks) {
+	printf("  i_flags    = %x\n", spi->i_flags);
+	printf("  i_ind      = %d\n", spi->i_ind);
+	printf("  i_dind     = %d\n", spi->i_dind);
+	get_map(spi, addr);
+    if (spi->i_blocks && (spi->i_flags & SP_INODE_EXTENTS)) {
+        for (i=0 ; i < SP_MAX_EXTENTS && spi->i_extent[i].e_len ; i++) {
+            ext = &spi->i_extent[i];
+            printf("  i_extent[%2d] = lblk %3d, len %3d, pblk %3d\n",
+                   i, ext->e_lblk, ext->e_len, ext->e_pblk);
+        }
+    } else if (spi->i_blocks) {
         for (i=0 ; i<SP_DIRECT_BLOCKS; i++) {
             if (i % 3 == 0 && pi == 3) {
                     printf("\n");
                     pi = 0;
             }
             if (spi->i_addr[i] != 0) {
-                printf("  i_addr[%2d] = %3d ", i, spi->i_addr[i]);
+                printf("  i_addr[%2d] = %3d%c", i, SP_ADDR_BLOCK(spi->i_addr[i]),
+                       (spi->i_addr[i] & SP_ADDR_UNWRITTEN) ? 'u' : ' ');
                 pi++;
             }
         }
@@ -299,10 +476,10 @@ print_inode(int inum, struct sp_inode *spi)
 	if (S_ISDIR(spi->i_mode)) {
 		printf("\n\n  Directory entries:\n");
 		for (i=0 ; i < spi->i_blocks ; i++) {
-			lseek(devfd, spi->i_addr[i] * SP_BSIZE, SEEK_SET);
-			read(devfd, buf, SP_BSIZE);
+			lseek(devfd, addr[i] * bsize, SEEK_SET);
+			read(devfd, buf, bsize);
 			dirent = (struct sp_dirent *)buf;
-			for (x = 0 ; x < SP_BSIZE / sizeof(struct sp_dirent) ; x++) {
+			for (x = 0 ; x < bsize / sizeof(struct sp_dirent) ; x++) {
 				if (dirent->d_ino != 0) {
 					printf("    inum[%2d], name[%s]\n",
 						   dirent->d_ino, dirent->d_name);
@@ -344,6 +521,7 @@ main(int argc, char **argv)
 		printf("This is not an SPFS filesystem\n");
 		return(1);
 	}
+	bsize = sb.s_bsize ? sb.s_bsize : SP_BSIZE;
 
 	while (1) {
 		printf("spfsdb > ") ;
@@ -373,15 +551,18 @@ main(int argc, char **argv)
 			}
 		}
 		if (command[0] == 's' && command[1] == 'd') {
-			for (i=0 ; i < (SP_MAXBLOCKS - SP_FIRST_DATA_BLOCK) ; i++) {
-				printf("  s_block[%3d] = %s", SP_FIRST_DATA_BLOCK + i, 
-					   sb.s_block[i] == SP_BLOCK_INUSE ? "inuse" : "free ");
+			for (i=0 ; i < SP_DATA_BLOCKS ; i++) {
+				printf("  block[%3d] = %s", SP_FIRST_DATA_BLOCK + i, 
+					   block_inuse(i) ? "inuse" : "free ");
                 if ((i+1) % 3 == 0) {
                    printf("\n");
                 }
 			}
             printf("\n");
         }
+		if (command[0] == 's' && command[1] == 'f') {
+			print_freespace();
+		}
 		if (command[0] == 's' && command[1] == 'i') {
 			for (i=0 ; i<42 ; i++) {
 				printf("  s_inode[%2d] = %s", i, 
@@ -398,6 +579,9 @@ main(int argc, char **argv)
 				   "SP_FSCLEAN" : "SP_FSDIRTY");
 			printf("  s_nifree  = %d\n", sb.s_nifree);
 			printf("  s_nbfree  = %d\n", sb.s_nbfree);
+			printf("  s_features = 0x%x%s\n", sb.s_features,
+				   (sb.s_features & SP_FEATURE_EXTENTS) ? " (extents)" : "");
+			printf("  s_bsize   = %d\n", bsize);
 		}
 	}
 }
@@ -17,11 +17,13 @@
 #include <fcntl.h>
 #include <string.h>
 #include <time.h>
+#include <stdlib.h>
 #include <linux/fs.h>
 #include <sys/stat.h>
 #include "../kern/spfs.h"
 
 int devfd;
+int bsize = SP_BSIZE;
 
 /*
  * fill_in_inode() - write an inode to disk. We will in the fields of
@@ -48,7 +50,7 @@ fill_in_inode(struct sp_inode *inode, int type, int uid, int gid,
 	inode->i_mode = (__u32)type;
 	inode->i_nlink = (__u32)nlink;
 
-	lseek(devfd, (SP_INODE_BLOCK + inum) * SP_BSIZE, SEEK_SET);
+	lseek(devfd, (off_t)(SP_INODE_BLOCK + inum) * bsize, SEEK_SET);
 	write(devfd, (char *)inode, sizeof(struct sp_inode));
 }
 
@@ -68,18 +70,47 @@ main(int argc, char **argv)
         off_t                   nsectors = SP_MAXBLOCKS;
         int                     error, i;
         int                     map_blks, inum;
-        char                    block[SP_BSIZE];
+        static char             block[SP_MAX_BSIZE];
+        int                     extents = 0, c;
 
-        if (argc != 2) {
+        /*
+         * "mkfs -e device" makes a filesystem whose inodes store their
+         * block maps as extents (see struct sp_extent). "-b bsize" picks
+         * the block size, a power of 2 from SP_BSIZE to SP_MAX_BSIZE. 
+         * The filesystem is always SP_MAXBLOCKS blocks so its size goes 
+         * up with the block size.
+         */
+
+        while ((c = getopt(argc, argv, "eb:")) != -1) {
+                switch (c) {
+                case 'e':
+                        extents = 1;
+                        break;
+                case 'b':
+                        bsize = atoi(optarg);
+                        if (bsize < SP_BSIZE || bsize > SP_MAX_BSIZE ||
+                            (bsize & (bsize - 1)) != 0) {
+                                fprintf(stderr, "SPFS mkfs: Block size must"
+                                        " be a power of 2 from %d to %d\n",
+                                        SP_BSIZE, SP_MAX_BSIZE);
+                                return(1);
+                        }
+                        break;
+                default:
+                        argc = 0;
+                }
+        }
+        if (argc - optind != 1) {
                 fprintf(stderr, "SPFS mkfs: Need to specify device\n");
+                fprintf(stderr, "usage: mkfs [-e] [-b bsize] device\n");
                 return(1);
         }
-        devfd = open(argv[1], O_WRONLY);
+        devfd = open(argv[optind], O_WRONLY);
         if (devfd < 0) {
                 fprintf(stderr, "SPFS mkfs: Failed to open device\n");
                 return(1);
         }
-        error = lseek(devfd, (off_t)(nsectors * SP_BSIZE) - 1, SEEK_SET);
+        error = lseek(devfd, (off_t)(nsectors * bsize) - 1, SEEK_SET);
         if (error == -1) {
                 fprintf(stderr, "SPFS mkfs: Cannot create filesystem"
                         " of default size\n");
@@ -98,7 +129,11 @@ main(int argc, char **argv)
         sb.s_magic = SP_MAGIC;
         sb.s_mod = SP_FSCLEAN;
         sb.s_nifree = SP_MAXFILES - 4;  /* 0 & 1 unused, root and lost+found */
-        sb.s_nbfree = SP_MAXBLOCKS - SP_FIRST_DATA_BLOCK - 2; /* dirents */
+        sb.s_nbfree = SP_DATA_BLOCKS - 2; /* dirents */
+        sb.s_bsize = bsize;
+        if (extents) {
+                sb.s_features = SP_FEATURE_EXTENTS;
+        }
 
         /*
          * First 4 inodes are in use. Inodes 0 and 1 are not
@@ -113,12 +148,12 @@ main(int argc, char **argv)
 
         /*
          * The first two blocks are allocated for the directory entries
-         * for the root and lost+found directories. Others were 
-		 * marked FREE (0) by memset above.
+         * for the root and lost+found directories so bits 0 and 1 of
+         * the block bitmap are set. Others were marked FREE (0) by 
+		 * memset above.
          */
 
-        sb.s_block[0] = SP_BLOCK_INUSE; /* root directory entries */
-        sb.s_block[1] = SP_BLOCK_INUSE; /* lost_found directory entries */
+        sb.s_bmap[0] = 0x3; /* root and lost+found directory entries */
 
         write(devfd, (char *)&sb, sizeof(struct sp_superblock));
 
@@ -148,10 +183,10 @@ main(int argc, char **argv)
          * Fill in the directory entries for root 
          */
 
-        lseek(devfd, SP_FIRST_DATA_BLOCK * SP_BSIZE, SEEK_SET);
-        memset((void *)block, 0, SP_BSIZE);
-        write(devfd, block, SP_BSIZE);
-        lseek(devfd, SP_FIRST_DATA_BLOCK * SP_BSIZE, SEEK_SET);
+        lseek(devfd, (off_t)SP_FIRST_DATA_BLOCK * bsize, SEEK_SET);
+        memset((void *)block, 0, bsize);
+        write(devfd, block, bsize);
+        lseek(devfd, (off_t)SP_FIRST_DATA_BLOCK * bsize, SEEK_SET);
         dir.d_ino = 2;
         strcpy(dir.d_name, ".");
         write(devfd, (char *)&dir, sizeof(struct sp_dirent));
@@ -166,10 +201,10 @@ main(int argc, char **argv)
          * Fill in the directory entries for lost+found 
          */
 
-        lseek(devfd, (SP_FIRST_DATA_BLOCK * SP_BSIZE) + SP_BSIZE, SEEK_SET);
-        memset((void *)block, 0, SP_BSIZE);
-        write(devfd, block, SP_BSIZE);
-        lseek(devfd, SP_FIRST_DATA_BLOCK * SP_BSIZE + SP_BSIZE, SEEK_SET);
+        lseek(devfd, (off_t)(SP_FIRST_DATA_BLOCK + 1) * bsize, SEEK_SET);
+        memset((void *)block, 0, bsize);
+        write(devfd, block, bsize);
+        lseek(devfd, (off_t)(SP_FIRST_DATA_BLOCK + 1) * bsize, SEEK_SET);
         dir.d_ino = 3;
         strcpy(dir.d_name, ".");
         write(devfd, (char *)&dir, sizeof(struct sp_dirent));
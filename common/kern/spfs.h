@@ -1,26 +1,39 @@
 // SPDX-License-Identifier: GPL-2.0
 
 /*
- * spfs.h - On-disk as well as in-core SPFS structures.
+ * spfs.h - On-disk SPFS structures, shared by the commands. Each kernel
+ *          module has its own spfs.h with the in-core structures.
  *
  * Copyright (c) 2023-2024 Steve D. Pate
  */
 
 #define SP_BSIZE                2048
+#define SP_MAX_BSIZE            65536
 #define SP_MAXFILES             128
 #define SP_MAXBLOCKS            760
 #define SP_NAMELEN              28        
 #define SP_DIRENT_SIZE 			32        
-#define SP_DIRS_PER_BLOCK       64
+#define SP_DIRS_PER_BLOCK(bs)   ((bs) / SP_DIRENT_SIZE)
 #define SP_DIRECT_BLOCKS        247
 #define SP_FIRST_DATA_BLOCK     129
 #define SP_MAGIC                0x53504653
 #define SP_INODE_BLOCK          1
 #define SP_ROOT_INO             2
+#define SP_DATA_BLOCKS          (SP_MAXBLOCKS - SP_FIRST_DATA_BLOCK)
+#define SP_BMAP_WORDS           ((SP_DATA_BLOCKS + 31) / 32)
 
 /*
  * The on-disk superblock. The number of inodes and 
- * data blocks is fixed.
+ * data blocks is fixed. Data blocks are tracked with a bitmap,
+ * one bit per block. Bit 0 of s_bmap[0] is SP_FIRST_DATA_BLOCK,
+ * bit 1 is SP_FIRST_DATA_BLOCK + 1 and so on. A set bit means
+ * the block is in use. s_features holds optional format features 
+ * chosen at mkfs time.
+ *
+ * s_bsize is the block size, a power of two from SP_BSIZE to 
+ * SP_MAX_BSIZE chosen at mkfs time (0 means SP_BSIZE). The layout 
+ * is the same whatever the size, counted in blocks. The superblock
+ * is always at the start of block 0.
  */
 
 struct sp_superblock {
@@ -29,11 +42,38 @@ struct sp_superblock {
 	__u32	s_nifree;
 	__u32	s_inode[SP_MAXFILES];
 	__u32	s_nbfree;
-	__u16	s_block[SP_MAXBLOCKS];
+	__u32	s_bmap[SP_BMAP_WORDS];
+	__u32	s_features;
+	__u32	s_bsize;
 };
 
+#define SP_FEATURE_EXTENTS      0x0001    /* inodes may use extents */
+#define SP_FEATURE_ALL          (SP_FEATURE_EXTENTS)
+
 /*
- * The on-disk inode.
+ * An extent maps "e_len" logical blocks starting at "e_lblk" onto
+ * contiguous disk blocks starting at "e_pblk". SP_ADDR_UNWRITTEN may
+ * be set in e_pblk.
+ */
+
+struct sp_extent {
+	__u32	e_lblk;
+	__u32	e_len;
+	__u32	e_pblk;
+};
+
+#define SP_MAX_EXTENTS          ((SP_DIRECT_BLOCKS * 4) / 12)
+
+/*
+ * The on-disk inode. The block map is either SP_DIRECT_BLOCKS direct
+ * block addresses or, if SP_INODE_EXTENTS is set in i_flags, up to 
+ * SP_MAX_EXTENTS extents sorted by e_lblk. A zero e_len ends the list.
+ *
+ * Blocks beyond the direct map are reached through i_ind, a block of
+ * SP_ADDRS_PER_BLOCK addresses, and then i_dind, a block of addresses
+ * of such blocks. Entries in indirect blocks are in the same form as
+ * i_addr[] entries. How many blocks they map depends on the block 
+ * size "bs".
  */
 
 struct sp_inode {
@@ -46,9 +86,32 @@ struct sp_inode {
 	__u32	i_gid;
 	__u32	i_size;
 	__u32	i_blocks;
-	__u32	i_addr[SP_DIRECT_BLOCKS];
+	union {
+		__u32				i_addr[SP_DIRECT_BLOCKS];
+		struct sp_extent	i_extent[SP_MAX_EXTENTS];
+	};
+	__u32	i_flags;
+	__u32	i_ind;
+	__u32	i_dind;
 };
 
+#define SP_INODE_EXTENTS        0x0001    /* block map is extents */
+
+#define SP_ADDRS_PER_BLOCK(bs)  ((bs) / sizeof(__u32))
+#define SP_IND_BLOCKS(bs)       SP_ADDRS_PER_BLOCK(bs)
+#define SP_DIND_BLOCKS(bs)      (SP_ADDRS_PER_BLOCK(bs) * SP_ADDRS_PER_BLOCK(bs))
+#define SP_FILE_BLOCKS(bs)      (SP_DIRECT_BLOCKS + SP_IND_BLOCKS(bs) + \
+                                 SP_DIND_BLOCKS(bs))
+
+/*
+ * The top bit of an i_addr[] entry marks a block that has been 
+ * allocated by fallocate(2) but never written. Reads of it return 
+ * zeros without going to disk.
+ */
+
+#define SP_ADDR_UNWRITTEN       0x80000000
+#define SP_ADDR_BLOCK(a)        ((a) & ~SP_ADDR_UNWRITTEN)
+
 /*
  * Allocation flags
  */
@@ -74,134 +137,20 @@ struct sp_dirent {
         char        d_name[SP_NAMELEN];
 };
 
-#ifdef __KERNEL__
-
 /*
- * In-core SPFS superblock
+ * Free space report returned by the SPFS_IOC_FREESPACE ioctl (fsdb's
+ * "sf" command prints the same thing). fs_hist[n] counts the free 
+ * extents of 2^n to 2^(n+1) - 1 blocks with the last bucket taking
+ * everything bigger. fs_frags[] holds the number of fragments in each
+ * file (0 for free inodes and symlinks).
  */
 
-struct spfs_sb_info {
-	unsigned long  	s_nifree;
-	unsigned long  	s_inode[SP_MAXFILES];
-	unsigned long  	s_nbfree;
-	unsigned long  	s_block[SP_MAXBLOCKS];
-	struct mutex 	s_lock;
-};
-
-/*
- * In-core SPFS inode
- */
+#define SP_FS_HIST        10
 
-struct sp_inode_info {
-    char            i_fs[4];
-	int				i_blocks;
-	int				i_addr[SP_DIRECT_BLOCKS];
-	char			i_symlink[SP_NAMELEN];
-    struct inode	vfs_inode;  
+struct sp_freespace {
+	__u32	fs_nbfree;
+	__u32	fs_nextents;
+	__u32	fs_largest;
+	__u32	fs_hist[SP_FS_HIST];
+	__u32	fs_frags[SP_MAXFILES];
 };
-
-#define	SPFS_SB		0x0001
-#define	SPFS_INODE	0x0002
-
-#define SBTOSPFSSB(sb)	(struct spfs_sb_info *)sb->s_fs_info
-#define ITOSPI(inode)   (struct sp_inode_info *)inode->i_private
-
-static inline struct sp_inode_info *spi_container(struct inode *inode)
-{
-    return container_of(inode, struct sp_inode_info, vfs_inode);
-}
-
-/*
- * Functions and structures defined throughout the source code.
- */
-
-extern struct address_space_operations sp_aops;
-extern struct inode_operations sp_file_inops;
-extern struct inode_operations sp_dir_inops;
-extern struct file_operations sp_dir_operations;
-extern struct file_operations sp_file_operations;
-static const struct inode_operations sp_symlink_operations;
-
-/*
- * Functions from sp_alloc.c
- */
-
-extern ino_t sp_ialloc(struct super_block *);
-extern int sp_block_alloc(struct super_block *sb);
-
-/*
- * Functions from sp_dir.c
- */
-
-extern int sp_dirdel(struct inode *dip, char *name);
-extern int sp_diradd(struct inode *dip, const char *name, int inum);
-extern int sp_rename(struct user_namespace *mnt_userns, struct inode *old_dir,
-                     struct dentry *old_dentry, struct inode *new_dir,
-                     struct dentry *new_dentry, unsigned int flags);
-extern int sp_readdir(struct file *f, struct dir_context *ctx);
-extern struct inode *sp_new_inode(struct inode *dip, struct dentry *dentry, 
-                                   umode_t mode, const char *symlink_target);
-extern int sp_create(struct user_namespace *mnt_userns, struct inode *dip,
-                     struct dentry *dentry, umode_t mode, bool excl);
-extern int sp_mkdir(struct user_namespace *mnt_userns, struct inode *dip,
-                    struct dentry *dentry, umode_t mode);
-extern int sp_rmdir(struct inode *dip, struct dentry *dentry);
-extern struct dentry *sp_lookup(struct inode *dip, struct dentry *dentry, 
-                                unsigned int flags);
-extern int sp_getattr(struct user_namespace *mnt_userns, 
-                      const struct path *path, struct kstat *stat, 
-                      u32 request_mask, unsigned int flags);
-extern int sp_readlink(struct dentry *dentry, char __user *buffer, 
-                              int buflen);
-extern const char *sp_page_get_link(struct dentry *dentry, struct inode *inode,
-                                    struct delayed_call *callback);
-extern int sp_symlink(struct user_namespace *mnt_userns, struct inode *dip,
-                      struct dentry *dentry, const char *target);
-extern int sp_link(struct dentry *old, struct inode *dip, struct dentry *new);
-extern int sp_unlink(struct inode *dip, struct dentry *dentry);
-
-/*
- * Functions from sp_inode.c
- */
-
-extern int sp_find_entry(struct inode *, char *);
-extern int sp_unlink(struct inode *, struct dentry *);
-extern int sp_link(struct dentry *, struct inode *, struct dentry *);
-extern struct inode *sp_read_inode(struct super_block *sb, unsigned long ino);
-extern int sp_write_inode(struct inode *inode, struct writeback_control *wbc);
-extern void sp_free_inode(struct inode *inode);
-extern void sp_evict_inode(struct inode *inode);
-extern void sp_put_super(struct super_block *sb);
-extern int sp_statfs(struct dentry *dentry, struct kstatfs *buf);
-extern struct inode * sp_alloc_inode(struct super_block *sb);
-extern int spfs_fill_super(struct super_block *sb, void *data, 
-                                  int silent);
-extern struct dentry *spfs_mount(struct file_system_type *fs_type, int flags,
-                                 const char *dev_name, void *data);
-
-
-/*
- * Functions from sp_file.c	
- */
-
-extern int sp_get_block(struct inode *inode, sector_t block,
-                        struct buffer_head *bh_result, int create);
-extern void sp_write_failed(struct address_space *mapping, loff_t to);
-extern int sp_write_begin(struct file *file, 
-                                 struct address_space *mapping, loff_t pos, 
-                                 unsigned len, struct page **pagep, 
-                                 void **fsdata);
-extern int sp_write_end(struct file *file, struct address_space *mapping,
-                               loff_t pos, unsigned len, unsigned copied,
-                               struct page *page, void *fsdata);
-extern int sp_writepage(struct page *page, struct writeback_control *wbc);
-extern int sp_read_folio(struct file *file, struct folio *folio);
-extern sector_t sp_bmap(struct address_space *mapping, sector_t block);
-
-/*
- * Functions from sp_ioctl.c
- */
-
-extern long sp_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
-
-#endif
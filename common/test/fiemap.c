@@ -0,0 +1,52 @@
+/*
+ * Print the extents of a file with a single FS_IOC_FIEMAP call, the
+ * way filefrag -v does. Holes don't appear, unwritten (fallocated)
+ * and delayed allocation extents are flagged. With no argument the
+ * file is /mnt/foo (see sparse.c).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#define NEXTENTS    256
+
+int
+main(int argc, char *argv[])
+{
+    char                *file = (argc > 1) ? argv[1] : "/mnt/foo";
+    struct fiemap       *fm;
+    struct fiemap_extent *fe;
+    int                 fd, i;
+
+    fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+    fm = calloc(1, sizeof(*fm) + NEXTENTS * sizeof(*fe));
+    fm->fm_start = 0;
+    fm->fm_length = FIEMAP_MAX_OFFSET;
+    fm->fm_flags = FIEMAP_FLAG_SYNC;
+    fm->fm_extent_count = NEXTENTS;
+    if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0) {
+        perror("FS_IOC_FIEMAP");
+        exit(1);
+    }
+    printf("%d extents\n", fm->fm_mapped_extents);
+    for (i = 0 ; i < fm->fm_mapped_extents ; i++) {
+        fe = &fm->fm_extents[i];
+        printf("logical %lld physical %lld length %lld%s%s%s\n",
+               (long long)fe->fe_logical, (long long)fe->fe_physical,
+               (long long)fe->fe_length,
+               (fe->fe_flags & FIEMAP_EXTENT_UNWRITTEN) ? " unwritten" : "",
+               (fe->fe_flags & FIEMAP_EXTENT_DELALLOC) ? " delalloc" : "",
+               (fe->fe_flags & FIEMAP_EXTENT_LAST) ? " last" : "");
+    }
+    close(fd);
+    return 0;
+}
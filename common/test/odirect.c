@@ -0,0 +1,54 @@
+/*
+ * Write a file with O_DIRECT, read it back with O_DIRECT and check
+ * that we get back what we wrote. The buffer must be aligned for
+ * O_DIRECT so it comes from posix_memalign(). Run with SPFS mounted
+ * on /mnt.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define BSIZE   2048
+#define NBLOCKS 64
+
+int
+main()
+{
+    char    *wbuf, *rbuf;
+    int     fd, i, nbytes = BSIZE * NBLOCKS;
+
+    if (posix_memalign((void **)&wbuf, BSIZE, nbytes) ||
+        posix_memalign((void **)&rbuf, BSIZE, nbytes)) {
+        printf("Failed to allocate buffers\n");
+        exit(1);
+    }
+    for (i = 0 ; i < nbytes ; i++) {
+        wbuf[i] = 'a' + (i / BSIZE) % 26;
+    }
+
+    fd = open("/mnt/odirect", O_CREAT|O_RDWR|O_DIRECT, 0644);
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+    if (pwrite(fd, wbuf, nbytes, 0) != nbytes) {
+        perror("pwrite");
+        exit(1);
+    }
+    if (pread(fd, rbuf, nbytes, 0) != nbytes) {
+        perror("pread");
+        exit(1);
+    }
+    if (memcmp(wbuf, rbuf, nbytes) != 0) {
+        printf("FAIL: data read back doesn't match\n");
+        exit(1);
+    }
+    printf("Wrote and read back %d bytes with O_DIRECT\n", nbytes);
+    close(fd);
+    unlink("/mnt/odirect");
+    return 0;
+}
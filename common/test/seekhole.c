@@ -0,0 +1,44 @@
+/*
+ * Walk a file with SEEK_DATA and SEEK_HOLE and print the ranges that
+ * hold data. Used by sparse_test. With no argument the file is
+ * /mnt/foo (see sparse.c).
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+int
+main(int argc, char *argv[])
+{
+    char    *file = (argc > 1) ? argv[1] : "/mnt/foo";
+    off_t   data, hole = 0;
+    int     fd;
+
+    fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+    while (1) {
+        data = lseek(fd, hole, SEEK_DATA);
+        if (data < 0) {
+            if (errno != ENXIO) {
+                perror("SEEK_DATA");
+                exit(1);
+            }
+            break;              /* no more data */
+        }
+        hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0) {
+            perror("SEEK_HOLE");
+            exit(1);
+        }
+        printf("data %lld - %lld\n", (long long)data, (long long)hole - 1);
+    }
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copy a file with sendfile(2), which splices page cache pages from
+ * the source without copying them through user space. With -r copy it
+ * with a read/write loop through an 8K buffer instead, like mycp.c,
+ * so the two can be compared. Used by splice_bench.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+int
+main(int argc, char *argv[])
+{
+    char        buf[8192];
+    struct stat st;
+    off_t       off = 0;
+    ssize_t     res;
+    int         fd1, fd2, rw = 0;
+
+    if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+        rw = 1;
+        argc--;
+        argv++;
+    }
+    if (argc != 3) {
+        printf("usage: sendfile [-r] from to\n");
+        exit(1);
+    }
+    fd1 = open(argv[1], O_RDONLY);
+    fd2 = open(argv[2], O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd1 < 0 || fd2 < 0 || fstat(fd1, &st) < 0) {
+        perror(argv[1]);
+        exit(1);
+    }
+    if (rw) {
+        while ((res = read(fd1, buf, sizeof(buf))) > 0) {
+            if (write(fd2, buf, res) != res) {
+                perror("write");
+                exit(1);
+            }
+        }
+    } else {
+        while (off < st.st_size) {
+            res = sendfile(fd2, fd1, &off, st.st_size - off);
+            if (res <= 0) {
+                break;
+            }
+        }
+    }
+    if (res < 0) {
+        perror(rw ? "read" : "sendfile");
+        exit(1);
+    }
+    close(fd1);
+    close(fd2);
+    return 0;
+}
@@ -11,7 +11,7 @@
 #include <linux/string.h>
 #include <linux/buffer_head.h>
 #include <linux/time.h>
-#include "../../../common/kern/spfs.h"
+#include "spfs.h"
 
 /*
  * Called by sp_rmdir() and sp_unlink() to delete a file. We
@@ -9,71 +9,944 @@
 #include <linux/module.h>
 #include <linux/mm.h>
 #include <linux/slab.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
 #include <linux/init.h>
+#include <linux/bitmap.h>
+#include <linux/percpu_counter.h>
+#include <linux/random.h>
 #include <asm/uaccess.h>
 #include "spfs.h"
 
 /*
- * Allocate a new inode. We update the superblock and return
- * the inode number. If we drop out of the for loop, we must
- * have allocated an inode. The only time this will fail is
- * if (sbi->s_nifree == 0) which we check first.
+ * Pick an inode group for a new top-level directory. This is a much 
+ * simplified version of the Orlov allocator used by ext2/3/4. Top-level
+ * directories are usually unrelated to each other so we spread them out,
+ * starting at a random group and taking the first one that has at least
+ * an average share of free inodes and free data blocks. If there is no
+ * such group, we take the group with the most free inodes. Returns -1
+ * if every group is full.
+ */
+
+static int
+sp_find_group_orlov(struct spfs_sb_info *sbi)
+{
+    s64     avefreei, avefreeb;
+    int     i, g, start, ifree, bfree, best = -1, best_ifree = 0;
+
+    avefreei = percpu_counter_read_positive(&sbi->s_nifree) / SP_NR_IGS;
+    avefreeb = percpu_counter_read_positive(&sbi->s_nbfree) / SP_NR_AGS;
+    start = get_random_u32_below(SP_NR_IGS);
+    for (i=0 ; i<SP_NR_IGS ; i++) {
+        g = (start + i) % SP_NR_IGS;
+        ifree = atomic_read(&sbi->s_ig_nfree[g]);
+        bfree = atomic_read(&sbi->s_ag[g % SP_NR_AGS].ag_nfree);
+        if (ifree > 0 && ifree >= avefreei && bfree >= avefreeb) {
+            return g;
+        }
+        if (ifree > best_ifree) {
+            best = g;
+            best_ifree = ifree;
+        }
+    }
+    return best;
+}
+
+/*
+ * Allocate a new inode for a file of type "mode" in the directory "dip".
+ * We update the superblock and return the inode number or 0 if there
+ * are no free inodes.
+ *
+ * To keep the inodes of a directory together in the inode table (inode 
+ * N lives in block SP_INODE_BLOCK + N) we search forward from the parent's
+ * inode number so siblings end up next to each other. New top-level 
+ * directories are spread over the inode groups instead (see 
+ * sp_find_group_orlov()) so that each gets room to grow.
+ *
+ * No lock is taken. A free inode is claimed with test_and_set_bit(). If 
+ * another CPU got there first, we carry on searching from the next inode.
+ * Inodes 0-3 are always in use so will never be returned.
  */
 
 ino_t
-sp_ialloc(struct super_block *sb)
+sp_ialloc(struct super_block *sb, struct inode *dip, umode_t mode)
 {
     struct spfs_sb_info  *sbi = SBTOSPFSSB(sb);
-    int                   i = 0;
+    unsigned long         i, start;
+    bool                  wrapped = false;
+    int                   group;
 
-    if (sbi->s_nifree == 0) {
+    if (percpu_counter_compare(&sbi->s_nifree, 1) < 0) {
         printk("spfs: Out of inodes\n");
+        return 0;
+    }
+    if (S_ISDIR(mode) && dip->i_ino == SP_ROOT_INO) {
+        group = sp_find_group_orlov(sbi);
+        start = (group < 0) ? 0 : group * SP_IG_INODES;
     } else {
-        mutex_lock(&sbi->s_lock);
-        for (i = 4 ; i < SP_MAXFILES ; i++) {
-            if (sbi->s_inode[i] == SP_INODE_FREE) {
-                sbi->s_inode[i] = SP_INODE_INUSE;
-                sbi->s_nifree--;
-                printk("spfs: sp_ialloc alloc inode %d\n", i);
-                mutex_unlock(&sbi->s_lock);
-                break;
+        start = dip->i_ino;
+    }
+    for (;;) {
+        i = find_next_zero_bit(sbi->s_imap, SP_MAXFILES, start);
+        if (i >= SP_MAXFILES) {
+            if (wrapped || start == 0) {
+                printk("spfs: Out of inodes\n");
+                return 0;
             }
+            wrapped = true;
+            start = 0;
+            continue;
+        }
+        if (!test_and_set_bit(i, sbi->s_imap)) {
+            break;
         }
+        start = i + 1;
     }
+    atomic_dec(&sbi->s_ig_nfree[i / SP_IG_INODES]);
+    percpu_counter_dec(&sbi->s_nifree);
+    printk("spfs: sp_ialloc alloc inode %d\n", (int)i);
     return i;
 }
 
 /*
- * Allocate a new data block. We update the superblock and return
- * the new block number.
+ * Free an inode.
  */
 
-int
-sp_block_alloc(struct super_block *sb)
+void
+sp_ifree(struct super_block *sb, ino_t ino)
+{
+    struct spfs_sb_info  *sbi = SBTOSPFSSB(sb);
+
+    clear_bit(ino, sbi->s_imap);
+    atomic_inc(&sbi->s_ig_nfree[ino / SP_IG_INODES]);
+    percpu_counter_inc(&sbi->s_nifree);
+}
+
+/*
+ * Clear the bit for block "blk" and count it against its group in "nfree".
+ */
+
+static void
+sp_free_one(struct spfs_sb_info *sbi, int blk, unsigned int *nfree)
+{
+    unsigned int    bno, agno;
+
+    bno = blk - SP_FIRST_DATA_BLOCK;
+    agno = bno / SP_AG_BLOCKS;
+    clear_bit(bno - sbi->s_ag[agno].ag_first, sbi->s_ag[agno].ag_bmap);
+    nfree[agno]++;
+}
+
+/*
+ * Free one block map entry, counting delayed allocations in "*nres".
+ */
+
+static void
+sp_free_addr(struct spfs_sb_info *sbi, int addr, unsigned int *nfree, 
+             unsigned int *nres)
+{
+    if (addr == SP_DELALLOC_ADDR) {
+        (*nres)++;
+    } else if (addr != 0) {
+        sp_free_one(sbi, sp_addr_block(addr), nfree);
+    }
+}
+
+/*
+ * Clear the bits for every block in the block map "addr" and count how
+ * many were freed in each group in "nfree" and how many delayed
+ * allocation reservations there were in "*nres". The group and
+ * superblock counts are left for the caller to update so that a batch
+ * of files only updates them once.
+ */
+
+static void
+sp_free_map(struct spfs_sb_info *sbi, const int *addr, 
+            unsigned int *nfree, unsigned int *nres)
+{
+    int             i;
+
+    for (i=0 ; i<SP_DIRECT_BLOCKS ; i++) {
+        sp_free_addr(sbi, addr[i], nfree, nres);
+    }
+}
+
+static void
+sp_free_counts(struct spfs_sb_info *sbi, unsigned int *nfree, 
+               unsigned int nres)
+{
+    s64     total = 0;
+    int     i;
+
+    for (i=0 ; i<SP_NR_AGS ; i++) {
+        if (nfree[i]) {
+            atomic_add(nfree[i], &sbi->s_ag[i].ag_nfree);
+            total += nfree[i];
+        }
+    }
+    percpu_counter_add(&sbi->s_nbfree, total);
+    if (nres) {
+        percpu_counter_sub(&sbi->s_dirtyblocks, nres);
+    }
+}
+
+/*
+ * Add a discard for each run of blocks in the block map "addr" to the
+ * chain of bios in "*biop".
+ */
+
+static void
+sp_discard_run(struct spfs_sb_info *sbi, int blk, int count, 
+               struct bio **biop)
+{
+    struct super_block  *sb = sbi->s_sb;
+    int                 shift = sb->s_blocksize_bits - SECTOR_SHIFT;
+
+    __blkdev_issue_discard(sb->s_bdev, (sector_t)blk << shift,
+                           (sector_t)count << shift, GFP_NOFS, biop);
+}
+
+static void
+sp_discard_map(struct spfs_sb_info *sbi, const int *addr, struct bio **biop)
+{
+    int                 i, count, blk;
+
+    for (i=0 ; i<SP_DIRECT_BLOCKS ; i += count) {
+        count = 1;
+        blk = sp_addr_block(addr[i]);
+        if (blk == 0) {
+            continue;
+        }
+        while (i + count < SP_DIRECT_BLOCKS &&
+               sp_addr_block(addr[i + count]) == blk + count) {
+            count++;
+        }
+        sp_discard_run(sbi, blk, count, biop);
+    }
+}
+
+/*
+ * Walk the indirect block "blk" ("depth" 1) or double indirect block
+ * ("depth" 2) of a removed file. If "biop" is set we add discards for
+ * the blocks it maps, and the block itself, to the chain. Otherwise 
+ * they're freed. Once freed, the buffer is forgotten so a stale dirty
+ * copy can't be written over the block after it's reallocated.
+ */
+
+static void
+sp_free_tree(struct spfs_sb_info *sbi, int blk, int depth,
+             unsigned int *nfree, struct bio **biop)
+{
+    struct buffer_head  *bh;
+    __le32              *p;
+    int                 apb = SP_ADDRS_PER_BLOCK(sbi->s_sb->s_blocksize);
+    int                 i, count, b;
+
+    if (blk == 0) {
+        return;
+    }
+    bh = sb_bread(sbi->s_sb, blk);
+    if (!bh) {
+        printk("spfs: sp_free_tree - unable to read block %d\n", blk);
+        return;
+    }
+    p = (__le32 *)bh->b_data;
+    for (i=0 ; i<apb ; i += count) {
+        count = 1;
+        b = le32_to_cpu(p[i]);
+        if (depth > 1) {
+            sp_free_tree(sbi, b, depth - 1, nfree, biop);
+            continue;
+        }
+        b = sp_addr_block(b);
+        if (b == 0) {
+            continue;
+        }
+        if (!biop) {
+            sp_free_one(sbi, b, nfree);
+            continue;
+        }
+        while (i + count < apb &&
+               sp_addr_block(le32_to_cpu(p[i + count])) == b + count) {
+            count++;
+        }
+        sp_discard_run(sbi, b, count, biop);
+    }
+    if (biop) {
+        brelse(bh);
+        sp_discard_run(sbi, blk, 1, biop);
+    } else {
+        bforget(bh);
+        sp_free_one(sbi, blk, nfree);
+    }
+}
+
+/*
+ * The background worker that frees the blocks of removed files. We 
+ * take everything that has been queued so far and free it as one batch
+ * so the group and superblock free counts are only updated once no 
+ * matter how many files or blocks there are.
+ *
+ * If mounted with "discard", the discards for the whole batch are 
+ * chained together and waited for once. That has to finish before the
+ * blocks are marked free or they could be reallocated and written 
+ * before the discard reaches the device.
+ */
+
+static void
+sp_free_worker(struct work_struct *work)
+{
+    struct spfs_sb_info  *sbi = container_of(work, struct spfs_sb_info,
+                                             s_free_work);
+    struct sp_free_req   *fr, *next;
+    struct bio           *bio = NULL;
+    unsigned int          nfree[SP_NR_AGS] = { 0 }, nres = 0;
+    LIST_HEAD(list);
+
+    spin_lock(&sbi->s_free_lock);
+    list_splice_init(&sbi->s_free_list, &list);
+    spin_unlock(&sbi->s_free_lock);
+
+    if (sbi->s_mount_opt & SP_MOUNT_DISCARD) {
+        list_for_each_entry(fr, &list, fr_list) {
+            sp_discard_map(sbi, fr->fr_addr, &bio);
+            sp_free_tree(sbi, fr->fr_ind, 1, nfree, &bio);
+            sp_free_tree(sbi, fr->fr_dind, 2, nfree, &bio);
+        }
+        if (bio) {
+            submit_bio_wait(bio);
+            bio_put(bio);
+        }
+    }
+    list_for_each_entry_safe(fr, next, &list, fr_list) {
+        sp_free_map(sbi, fr->fr_addr, nfree, &nres);
+        sp_free_tree(sbi, fr->fr_ind, 1, nfree, NULL);
+        sp_free_tree(sbi, fr->fr_dind, 2, nfree, NULL);
+        list_del(&fr->fr_list);
+        kfree(fr);
+    }
+    sp_free_counts(sbi, nfree, nres);
+}
+
+static void
+sp_queue_free(struct spfs_sb_info *sbi, struct sp_free_req *fr)
+{
+    spin_lock(&sbi->s_free_lock);
+    list_add_tail(&fr->fr_list, &sbi->s_free_list);
+    spin_unlock(&sbi->s_free_lock);
+    schedule_work(&sbi->s_free_work);
+}
+
+/*
+ * Called to free the blocks in the block map "addr" and the indirect 
+ * blocks "ind" and "dind". So that the caller doesn't have to wait for
+ * the blocks to be freed, we queue a copy of the map for 
+ * sp_free_worker(). If we can't get memory for the copy, the blocks 
+ * are freed here instead.
+ */
+
+void
+sp_free_blocks_deferred(struct super_block *sb, int *addr, int ind, int dind)
 {
     struct spfs_sb_info  *sbi = SBTOSPFSSB(sb);
+    struct sp_free_req   *fr;
+    unsigned int          nfree[SP_NR_AGS] = { 0 }, nres = 0;
+
+    fr = kmalloc(sizeof(struct sp_free_req), GFP_NOFS);
+    if (!fr) {
+        sp_free_map(sbi, addr, nfree, &nres);
+        sp_free_tree(sbi, ind, 1, nfree, NULL);
+        sp_free_tree(sbi, dind, 2, nfree, NULL);
+        sp_free_counts(sbi, nfree, nres);
+        return;
+    }
+    memcpy(fr->fr_addr, addr, sizeof(fr->fr_addr));
+    fr->fr_ind = ind;
+    fr->fr_dind = dind;
+    sp_queue_free(sbi, fr);
+}
+
+/*
+ * The same for a file that has been removed, taking the block map 
+ * from the in-core inode. The direct map is expanded straight into 
+ * the request.
+ */
+
+void
+sp_free_inode_blocks(struct inode *inode)
+{
+    struct spfs_sb_info  *sbi = SBTOSPFSSB(inode->i_sb);
+    struct sp_inode_info *spi = ITOSPI(inode);
+    struct sp_free_req   *fr;
+    unsigned int          nfree[SP_NR_AGS] = { 0 }, nres = 0;
     int                   i;
 
-    if (sbi->s_nbfree == 0) {
-        printk("spfs: Out of space\n");
-        return 0;
+    fr = kmalloc(sizeof(struct sp_free_req), GFP_NOFS);
+    if (!fr) {
+        for (i=0 ; i<SP_DIRECT_BLOCKS ; i++) {
+            sp_free_addr(sbi, sp_dmap_get(spi, i), nfree, &nres);
+        }
+        sp_free_tree(sbi, spi->i_ind, 1, nfree, NULL);
+        sp_free_tree(sbi, spi->i_dind, 2, nfree, NULL);
+        sp_free_counts(sbi, nfree, nres);
+        return;
+    }
+    sp_dmap_copy(spi, fr->fr_addr);
+    fr->fr_ind = spi->i_ind;
+    fr->fr_dind = spi->i_dind;
+    sp_queue_free(sbi, fr);
+}
+
+/*
+ * Wait for any queued frees to finish. Returns true if there were 
+ * any, in which case it's worth an allocator that ran out of space 
+ * trying again. Also used at unmount before the bitmaps are written.
+ */
+
+bool
+sp_flush_frees(struct spfs_sb_info *sbi)
+{
+    return flush_work(&sbi->s_free_work);
+}
+
+/*
+ * FITRIM. Discard the free blocks in the range described by "range"
+ * in runs of at least range->minlen bytes. On return range->len is
+ * the number of bytes discarded.
+ *
+ * Each free run is claimed in the group bitmap while its discard is
+ * in flight so the allocator can't hand it out and have it written 
+ * before the discard gets to the device. The free counts aren't
+ * touched so the space still looks free while we're trimming.
+ */
+
+int
+sp_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+    struct spfs_sb_info  *sbi = SBTOSPFSSB(sb);
+    struct sp_agroup     *ag;
+    unsigned long         s, e, i, n, k;
+    u64                   start, end, minblocks, trimmed = 0;
+    int                   agno, error = 0;
+
+    start = range->start >> sb->s_blocksize_bits;
+    if (start >= SP_MAXBLOCKS) {
+        return -EINVAL;
+    }
+    end = start + min_t(u64, range->len >> sb->s_blocksize_bits, 
+                        SP_MAXBLOCKS);
+    minblocks = max_t(u64, range->minlen >> sb->s_blocksize_bits, 1);
+    start = max_t(u64, start, SP_FIRST_DATA_BLOCK) - SP_FIRST_DATA_BLOCK;
+    end = min_t(u64, end, SP_MAXBLOCKS);
+    end = max_t(u64, end, SP_FIRST_DATA_BLOCK) - SP_FIRST_DATA_BLOCK;
+
+    for (agno = start / SP_AG_BLOCKS ; agno < SP_NR_AGS ; agno++) {
+        ag = &sbi->s_ag[agno];
+        if (ag->ag_first >= end) {
+            break;
+        }
+        s = max_t(u64, start, ag->ag_first) - ag->ag_first;
+        e = min_t(u64, end, ag->ag_first + ag->ag_nblocks) - ag->ag_first;
+        while (s < e) {
+            i = find_next_zero_bit(ag->ag_bmap, e, s);
+            if (i >= e) {
+                break;
+            }
+            n = find_next_bit(ag->ag_bmap, e, i) - i;
+            s = i + n;
+            if (n < minblocks) {
+                continue;
+            }
+            for (k = 0 ; k < n ; k++) {
+                if (test_and_set_bit(i + k, ag->ag_bmap)) {
+                    break;
+                }
+            }
+            if (k >= minblocks) {
+                error = sb_issue_discard(sb, SP_FIRST_DATA_BLOCK + 
+                                         ag->ag_first + i, k, GFP_NOFS, 0);
+            }
+            n = k;
+            for (k = 0 ; k < n ; k++) {
+                clear_bit(i + k, ag->ag_bmap);
+            }
+            if (error) {
+                goto out;
+            }
+            if (n >= minblocks) {
+                trimmed += n;
+            }
+            if (fatal_signal_pending(current)) {
+                error = -ERESTARTSYS;
+                goto out;
+            }
+            cond_resched();
+        }
+    }
+out:
+    range->len = trimmed << sb->s_blocksize_bits;
+    return error;
+}
+
+/*
+ * Fill in the free space part of a SPFS_IOC_FREESPACE report. The
+ * groups sit next to each other on disk so a free extent can run from
+ * the end of one group into the next. Nothing is locked so this is only
+ * a snapshot if blocks are being allocated or freed.
+ */
+
+void
+sp_free_extents(struct spfs_sb_info *sbi, struct sp_freespace *fs)
+{
+    struct sp_agroup    *ag;
+    unsigned int        bno, run = 0;
+
+    for (bno=0 ; bno<=SP_DATA_BLOCKS ; bno++) {
+        if (bno < SP_DATA_BLOCKS) {
+            ag = &sbi->s_ag[bno / SP_AG_BLOCKS];
+            if (!test_bit(bno - ag->ag_first, ag->ag_bmap)) {
+                fs->fs_nbfree++;
+                run++;
+                continue;
+            }
+        }
+        if (run) {
+            fs->fs_nextents++;
+            fs->fs_hist[min_t(int, ilog2(run), SP_FS_HIST - 1)]++;
+            fs->fs_largest = max(fs->fs_largest, run);
+            run = 0;
+        }
+    }
+}
+
+/*
+ * Set up the allocation groups and the per-CPU allocation hints. Every
+ * group has SP_AG_BLOCKS blocks except the last which gets whatever is
+ * left over. Each CPU's hint starts on a different bitmap word.
+ */
+
+int
+sp_init_alloc(struct spfs_sb_info *sbi)
+{
+    struct sp_agroup        *ag;
+    struct sp_alloc_hint    *hint;
+    int                     i, cpu;
+
+    for (i=0 ; i<SP_NR_AGS ; i++) {
+        ag = &sbi->s_ag[i];
+        ag->ag_first = i * SP_AG_BLOCKS;
+        ag->ag_nblocks = min_t(unsigned int, SP_AG_BLOCKS, 
+                               SP_DATA_BLOCKS - ag->ag_first);
+        atomic_set(&ag->ag_nfree, 0);
+        bitmap_zero(ag->ag_bmap, SP_AG_BLOCKS);
+    }
+    spin_lock_init(&sbi->s_free_lock);
+    INIT_LIST_HEAD(&sbi->s_free_list);
+    INIT_WORK(&sbi->s_free_work, sp_free_worker);
+
+    sbi->s_hint = alloc_percpu(struct sp_alloc_hint);
+    if (!sbi->s_hint) {
+        return -ENOMEM;
+    }
+    for_each_possible_cpu(cpu) {
+        hint = per_cpu_ptr(sbi->s_hint, cpu);
+        hint->ah_block = (cpu * BITS_PER_LONG) % SP_DATA_BLOCKS;
+    }
+    return 0;
+}
+
+/*
+ * The allocation group that new files of this inode should start in.
+ * That's the group paired with the inode's inode group so files in 
+ * the same directory keep their data together while files in different
+ * top-level directories are kept apart. Within the group we start at 
+ * this CPU's hint so that files being created at the same time on 
+ * different CPUs don't all race for the first free block of the group.
+ * The result is used as an allocation goal.
+ */
+
+int
+sp_inode_goal(struct inode *inode)
+{
+    struct spfs_sb_info  *sbi = SBTOSPFSSB(inode->i_sb);
+    unsigned int          agno, off;
+
+    agno = (inode->i_ino / SP_IG_INODES) % SP_NR_AGS;
+    off = this_cpu_read(sbi->s_hint->ah_block) % SP_AG_BLOCKS;
+    off = min(off, sbi->s_ag[agno].ag_nblocks - 1);
+    return SP_FIRST_DATA_BLOCK + agno * SP_AG_BLOCKS + off;
+}
+
+/*
+ * Allocate a run of up to "*count" blocks from a single allocation
+ * group starting the search at "start" (relative to the group). If 
+ * there's nothing free after "start" we wrap around to the beginning
+ * of the group. Returns the data block number (relative to
+ * SP_FIRST_DATA_BLOCK) or -1 if the group is full.
+ *
+ * The first block is claimed with test_and_set_bit(). If we lose the
+ * race for it we keep searching. The run is then extended one block
+ * at a time until we hit a block that's in use (or that somebody else
+ * just claimed) or have as many as the caller wanted.
+ */
+
+static int
+sp_ag_alloc(struct sp_agroup *ag, unsigned long start, unsigned int *count)
+{
+    unsigned long   i, n;
+    bool            wrapped = false;
+
+    if (atomic_read(&ag->ag_nfree) <= 0) {
+        return -1;
+    }
+    for (;;) {
+        i = find_next_zero_bit(ag->ag_bmap, ag->ag_nblocks, start);
+        if (i >= ag->ag_nblocks) {
+            if (wrapped || start == 0) {
+                return -1;
+            }
+            wrapped = true;
+            start = 0;
+            continue;
+        }
+        if (!test_and_set_bit(i, ag->ag_bmap)) {
+            break;
+        }
+        start = i + 1;
+    }
+    for (n = 1 ; n < *count && i + n < ag->ag_nblocks ; n++) {
+        if (test_and_set_bit(i + n, ag->ag_bmap)) {
+            break;
+        }
+    }
+    atomic_sub(n, &ag->ag_nfree);
+    *count = n;
+    return ag->ag_first + i;
+}
+
+/*
+ * Is there room to allocate "count" blocks that haven't been reserved?
+ * Blocks reserved for delayed allocation (s_dirtyblocks) aren't free 
+ * for anyone else to take. The approximate counts can each be out by 
+ * up to a per-CPU batch on every CPU, which on a small filesystem can
+ * be all of its free space, so when we're that close we use the exact
+ * sums.
+ */
+
+static bool
+sp_space_ok(struct spfs_sb_info *sbi, s64 count)
+{
+    s64     nfree, ndirty, slack;
+
+    nfree = percpu_counter_read_positive(&sbi->s_nbfree);
+    ndirty = percpu_counter_read_positive(&sbi->s_dirtyblocks);
+    slack = 2 * percpu_counter_batch * num_online_cpus();
+    if (nfree - ndirty - count >= slack) {
+        return true;
     }
+    nfree = percpu_counter_sum_positive(&sbi->s_nbfree);
+    ndirty = percpu_counter_sum_positive(&sbi->s_dirtyblocks);
+    return nfree - ndirty >= count;
+}
+
+/*
+ * Allocate a run of contiguous data blocks. "*count" is the number of
+ * blocks the caller would like. We return the first block of the run
+ * and set "*count" to the number actually allocated which is at least 
+ * one and may be less than was asked for. If "goal" is a data block, 
+ * we try to start the run at that block or the first free block after 
+ * it so that files which are written sequentially stay contiguous on 
+ * disk. A goal of 0 means the caller has no preference in which case 
+ * we start where this CPU last allocated.
+ *
+ * If the group we start in is full, we try each of the other groups
+ * in turn. "reserved" is set when the caller already holds a delayed
+ * allocation reservation for the blocks (see sp_block_alloc_reserved())
+ * in which case they're ours to take even if every free block is 
+ * spoken for.
+ */
+
+static int
+sp_alloc_run(struct super_block *sb, int goal, unsigned int *count,
+             bool reserved)
+{
+    struct spfs_sb_info  *sbi = SBTOSPFSSB(sb);
+    unsigned long         start = 0;
+    int                   agno, i, blk, orig_goal = goal;
+    bool                  flushed = false;
 
     /*
-     * Start looking at block 2. Block 0 is for the root directory.
-     * Block 1 is for lost+found.
+     * If we are out of space but there are blocks of removed files 
+     * waiting to be freed, we wait for them and try again.
      */
 
-    mutex_lock(&sbi->s_lock);
-    for (i = 1 ; i < SP_MAXBLOCKS ; i++) {
-        if (sbi->s_block[i] == SP_BLOCK_FREE) {
-            sbi->s_block[i] = SP_BLOCK_INUSE;
-            sbi->s_nbfree--;
-            mutex_unlock(&sbi->s_lock);
-            return SP_FIRST_DATA_BLOCK + i;
+retry:
+    if (!reserved && !sp_space_ok(sbi, 1)) {
+        if (!flushed && sp_flush_frees(sbi)) {
+            flushed = true;
+            goto retry;
+        }
+        printk("spfs: Out of space\n");
+        return 0;
+    }
+    if (goal >= SP_FIRST_DATA_BLOCK && goal < SP_MAXBLOCKS) {
+        goal -= SP_FIRST_DATA_BLOCK;
+    } else {
+        goal = this_cpu_read(sbi->s_hint->ah_block) % SP_DATA_BLOCKS;
+    }
+    agno = goal / SP_AG_BLOCKS;
+    start = goal % SP_AG_BLOCKS;
+
+    for (i=0 ; i<SP_NR_AGS ; i++) {
+        blk = sp_ag_alloc(&sbi->s_ag[agno], start, count);
+        if (blk >= 0) {
+            this_cpu_write(sbi->s_hint->ah_block, blk + *count);
+            percpu_counter_sub(&sbi->s_nbfree, *count);
+            return SP_FIRST_DATA_BLOCK + blk;
+        }
+        agno = (agno + 1) % SP_NR_AGS;
+        start = 0;
+    }
+    if (!flushed && sp_flush_frees(sbi)) {
+        flushed = true;
+        goal = orig_goal;
+        goto retry;
+    }
+    printk("spfs: Out of space\n");
+    return 0;
+}
+
+int
+sp_block_alloc_range(struct super_block *sb, int goal, unsigned int *count)
+{
+    return sp_alloc_run(sb, goal, count, false);
+}
+
+/*
+ * Allocate a run of blocks for delayed allocations that have space
+ * reserved by sp_reserve_blocks(). The reservation is left in place so
+ * nobody else can take the blocks while we look for them. The caller
+ * gives back the reservation for the blocks it got, with 
+ * sp_release_blocks(), once they're in the block map.
+ */
+
+int
+sp_block_alloc_reserved(struct super_block *sb, int goal, unsigned int *count)
+{
+    return sp_alloc_run(sb, goal, count, true);
+}
+
+/*
+ * Allocate a single data block. See sp_block_alloc_range().
+ */
+
+int
+sp_block_alloc(struct super_block *sb, int goal)
+{
+    unsigned int    count = 1;
+
+    return sp_block_alloc_range(sb, goal, &count);
+}
+
+/*
+ * Allocate exactly "count" contiguous blocks, which must be no more 
+ * than a group's worth, or nothing at all. This is for defragmentation
+ * where a shorter run is no use. We look for a big enough gap in each
+ * group in turn, starting with the one "goal" is in, and claim it a bit
+ * at a time. If another CPU takes one of the bits first we give back 
+ * what we got and carry on looking. Returns the first block or 0.
+ */
+
+int
+sp_block_alloc_exact(struct super_block *sb, int goal, unsigned int count)
+{
+    struct spfs_sb_info  *sbi = SBTOSPFSSB(sb);
+    struct sp_agroup     *ag;
+    unsigned long         i, k, start;
+    int                   agno = 0, n;
+
+    if (count > SP_AG_BLOCKS || !sp_space_ok(sbi, count)) {
+        return 0;
+    }
+    if (goal >= SP_FIRST_DATA_BLOCK && goal < SP_MAXBLOCKS) {
+        agno = (goal - SP_FIRST_DATA_BLOCK) / SP_AG_BLOCKS;
+    }
+    for (n=0 ; n<SP_NR_AGS ; n++, agno = (agno + 1) % SP_NR_AGS) {
+        ag = &sbi->s_ag[agno];
+        start = 0;
+        while (atomic_read(&ag->ag_nfree) >= (int)count) {
+            i = bitmap_find_next_zero_area(ag->ag_bmap, ag->ag_nblocks, 
+                                           start, count, 0);
+            if (i >= ag->ag_nblocks) {
+                break;
+            }
+            for (k = 0 ; k < count ; k++) {
+                if (test_and_set_bit(i + k, ag->ag_bmap)) {
+                    break;
+                }
+            }
+            if (k == count) {
+                atomic_sub(count, &ag->ag_nfree);
+                percpu_counter_sub(&sbi->s_nbfree, count);
+                return SP_FIRST_DATA_BLOCK + ag->ag_first + i;
+            }
+            while (k--) {
+                clear_bit(i + k, ag->ag_bmap);
+            }
+            start = i + 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Free "count" contiguous blocks starting at "blk". The run may
+ * span more than one allocation group. Allocators may be claiming
+ * other bits in the same words so each bit must be cleared atomically.
+ */
+
+void
+sp_block_free(struct super_block *sb, int blk, unsigned int count)
+{
+    struct spfs_sb_info  *sbi = SBTOSPFSSB(sb);
+    struct sp_agroup     *ag;
+    unsigned int          bno, n, i, total = count;
+
+    bno = blk - SP_FIRST_DATA_BLOCK;
+    while (count) {
+        ag = &sbi->s_ag[bno / SP_AG_BLOCKS];
+        n = min(count, ag->ag_first + ag->ag_nblocks - bno);
+        for (i = 0 ; i < n ; i++) {
+            clear_bit(bno - ag->ag_first + i, ag->ag_bmap);
+        }
+        atomic_add(n, &ag->ag_nfree);
+        bno += n;
+        count -= n;
+    }
+    percpu_counter_add(&sbi->s_nbfree, total);
+}
+
+/*
+ * Reserve "count" blocks for delayed allocation. Nothing is allocated
+ * but the blocks are taken out of the free space that other allocations
+ * can use, so that allocating them at writeback time can't fail. 
+ *
+ * We add the reservation first and then check that there's room for it
+ * so that two CPUs reserving at the same time can't both take the last
+ * free block. As with sp_block_alloc_range(), pending frees are waited
+ * for before giving up.
+ */
+
+int
+sp_reserve_blocks(struct super_block *sb, unsigned int count)
+{
+    struct spfs_sb_info  *sbi = SBTOSPFSSB(sb);
+    bool                  flushed = false;
+
+retry:
+    percpu_counter_add(&sbi->s_dirtyblocks, count);
+    if (!sp_space_ok(sbi, 0)) {
+        percpu_counter_sub(&sbi->s_dirtyblocks, count);
+        if (!flushed && sp_flush_frees(sbi)) {
+            flushed = true;
+            goto retry;
         }
+        return -ENOSPC;
     }
-    printk("spfs: sp_block_alloc - We should never reach here\n");
-    mutex_unlock(&sbi->s_lock);
     return 0;
 }
+
+/*
+ * Give back blocks reserved by sp_reserve_blocks(). This is called once
+ * the blocks have really been allocated or if they are never going to
+ * be written.
+ */
+
+void
+sp_release_blocks(struct super_block *sb, unsigned int count)
+{
+    struct spfs_sb_info  *sbi = SBTOSPFSSB(sb);
+
+    percpu_counter_sub(&sbi->s_dirtyblocks, count);
+}
+
+/*
+ * Copy the on-disk block bitmap into the allocation group bitmaps at 
+ * mount time. On disk the bitmap is held as little-endian 32-bit words
+ * and each group starts on a word boundary. We also count up how many 
+ * blocks are free in each group.
+ */
+
+void
+sp_read_bmap(struct spfs_sb_info *sbi, struct sp_superblock *dsb)
+{
+    struct sp_agroup    *ag;
+    __u32               words[SP_BMAP_WORDS];
+    int                 i;
+
+    for (i=0 ; i<SP_BMAP_WORDS ; i++) {
+        words[i] = le32_to_cpu(dsb->s_bmap[i]);
+    }
+    for (i=0 ; i<SP_NR_AGS ; i++) {
+        ag = &sbi->s_ag[i];
+        bitmap_from_arr32(ag->ag_bmap, &words[ag->ag_first / 32], 
+                          ag->ag_nblocks);
+        atomic_set(&ag->ag_nfree, ag->ag_nblocks - 
+                   bitmap_weight(ag->ag_bmap, ag->ag_nblocks));
+    }
+}
+
+/*
+ * The reverse of sp_read_bmap(). Called at unmount time.
+ */
+
+void
+sp_write_bmap(struct spfs_sb_info *sbi, struct sp_superblock *dsb)
+{
+    struct sp_agroup    *ag;
+    __u32               words[SP_BMAP_WORDS];
+    int                 i;
+
+    memset(words, 0, sizeof(words));
+    for (i=0 ; i<SP_NR_AGS ; i++) {
+        ag = &sbi->s_ag[i];
+        bitmap_to_arr32(&words[ag->ag_first / 32], ag->ag_bmap, 
+                        ag->ag_nblocks);
+    }
+    for (i=0 ; i<SP_BMAP_WORDS ; i++) {
+        dsb->s_bmap[i] = cpu_to_le32(words[i]);
+    }
+}
+
+/*
+ * The on-disk superblock keeps one 32-bit word per inode. In-core we
+ * only need a bit.
+ */
+
+void
+sp_read_imap(struct spfs_sb_info *sbi, struct sp_superblock *dsb)
+{
+    int     i;
+
+    bitmap_zero(sbi->s_imap, SP_MAXFILES);
+    for (i=0 ; i<SP_NR_IGS ; i++) {
+        atomic_set(&sbi->s_ig_nfree[i], SP_IG_INODES);
+    }
+    for (i=0 ; i<SP_MAXFILES ; i++) {
+        if (le32_to_cpu(dsb->s_inode[i]) == SP_INODE_INUSE) {
+            __set_bit(i, sbi->s_imap);
+            atomic_dec(&sbi->s_ig_nfree[i / SP_IG_INODES]);
+        }
+    }
+}
+
+void
+sp_write_imap(struct spfs_sb_info *sbi, struct sp_superblock *dsb)
+{
+    int     i;
+
+    for (i=0 ; i<SP_MAXFILES ; i++) {
+        dsb->s_inode[i] = cpu_to_le32(test_bit(i, sbi->s_imap) ?
+                                      SP_INODE_INUSE : SP_INODE_FREE);
+    }
+}
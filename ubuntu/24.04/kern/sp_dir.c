@@ -60,10 +60,10 @@ sp_dirdel(struct inode *dip, char *name)
 
 	printk("spfs: sp_dirdel for %s\n", name);
 	while (blk < spi->i_blocks) {
-		bh = sb_bread(sb, spi->i_addr[blk]);
+		bh = sb_bread(sb, sp_dmap_get(spi, blk));
 		blk++;
 		dirent = (struct sp_dirent *)bh->b_data;
-		for (i=0 ; i < SP_DIRS_PER_BLOCK ; i++) {
+		for (i=0 ; i < SP_DIRS_PER_BLOCK(sb->s_blocksize) ; i++) {
 			if (strcmp(dirent->d_name, name) != 0) {
 				dirent++;
 				continue;
@@ -96,9 +96,9 @@ sp_diradd(struct inode *dip, const char *name, int inum)
 	printk("spfs: sp_diradd for %s (inum = %d)\n", name, inum);
 
 	for (blk=0 ; blk < spi->i_blocks ; blk++) {
-		bh = sb_bread(sb, spi->i_addr[blk]);
+		bh = sb_bread(sb, sp_dmap_get(spi, blk));
 		dirent = (struct sp_dirent *)bh->b_data;
-		for (i=0 ; i < SP_DIRS_PER_BLOCK ; i++) {
+		for (i=0 ; i < SP_DIRS_PER_BLOCK(sb->s_blocksize) ; i++) {
 			if (dirent->d_ino != 0) { /* slot is occupied */
 				dirent++;
 				continue;
@@ -121,13 +121,19 @@ sp_diradd(struct inode *dip, const char *name, int inum)
 
 	if (spi->i_blocks < SP_DIRECT_BLOCKS) {
 		pos = spi->i_blocks;
-		blk = sp_block_alloc(sb);
+		blk = sp_block_alloc(sb, sp_dmap_get(spi, pos - 1) + 1);
+		mutex_lock(&spi->i_map_lock);
+		error = sp_dmap_set(spi, pos, blk);
+		mutex_unlock(&spi->i_map_lock);
+		if (error) {
+			sp_block_free(sb, blk, 1);
+			return error;
+		}
 		spi->i_blocks++;
 		dip->i_size += SP_DIRENT_SIZE;
 		dip->i_blocks++;
-		spi->i_addr[pos] = blk;
 		bh = sb_bread(sb, blk);
-		memset(bh->b_data, 0, SP_BSIZE);
+		memset(bh->b_data, 0, sb->s_blocksize);
 		mark_inode_dirty(dip);
 		dirent = (struct sp_dirent *)bh->b_data;
 		dirent->d_ino = inum;
@@ -177,14 +183,14 @@ sp_readdir(struct file *f, struct dir_context *ctx)
            (int)dip->i_size, (int)ctx->pos);
 
     while (ctx->pos < dip->i_size) {
-		offset = ctx->pos % SP_BSIZE;
-        blk = ctx->pos / SP_BSIZE;
-		disk_blk = spi->i_addr[blk];
+		offset = ctx->pos % dip->i_sb->s_blocksize;
+        blk = ctx->pos / dip->i_sb->s_blocksize;
+		disk_blk = sp_dmap_get(spi, blk);
 		printk("spfs: sp_readdir - blk = %d, disk_blk = %d\n", blk, disk_blk);
 
         bh = sb_bread(dip->i_sb, disk_blk);
         if (!bh) {
-            ctx->pos += SP_BSIZE - offset;
+            ctx->pos += dip->i_sb->s_blocksize - offset;
             continue;
         }
         do {
@@ -200,7 +206,7 @@ sp_readdir(struct file *f, struct dir_context *ctx)
             }
             offset += SP_DIRENT_SIZE;
             ctx->pos += SP_DIRENT_SIZE;
-        } while ((offset < SP_BSIZE) && (ctx->pos < dip->i_size));
+        } while ((offset < dip->i_sb->s_blocksize) && (ctx->pos < dip->i_size));
         brelse(bh);
     }
 	return 0;
@@ -209,6 +215,7 @@ sp_readdir(struct file *f, struct dir_context *ctx)
 struct file_operations sp_dir_operations = {
 	.iterate_shared	= sp_readdir,
 	.fsync			= generic_file_fsync,
+	.unlocked_ioctl	= sp_ioctl,
 };
 
 struct inode *
@@ -229,7 +236,7 @@ sp_new_inode(struct inode *dip, struct dentry *dentry, umode_t mode,
 	if (!inode) {
 		return ERR_PTR(-ENOMEM);
 	}
-	inum = sp_ialloc(sb);
+	inum = sp_ialloc(sb, dip, mode);
 	if (!inum) {
 		iput(inode);
 		return ERR_PTR(-ENOSPC);
@@ -247,13 +254,15 @@ sp_new_inode(struct inode *dip, struct dentry *dentry, umode_t mode,
     spi->i_fs[1] = 'P';
     spi->i_fs[2] = 'F';
     spi->i_fs[3] = 'S';
-	memset(spi->i_addr, 0, SP_DIRECT_BLOCKS);
+	spi->i_ind = 0;
+	spi->i_dind = 0;
 
 	if (S_ISREG(mode)) {
 		inode->i_blocks = 0;
 		inode->i_op = &sp_file_inops;
 		inode->i_fop = &sp_file_operations;
 		inode->i_mapping->a_ops = &sp_aops;
+		mapping_set_large_folios(inode->i_mapping);
 		inode->i_size = 0;
 		spi->i_blocks = 0;
 	} else if (S_ISDIR(mode)) {
@@ -263,10 +272,10 @@ sp_new_inode(struct inode *dip, struct dentry *dentry, umode_t mode,
 		inode->i_size = 2 * SP_DIRENT_SIZE;
 
 		spi->i_blocks = 1;
-		blk = sp_block_alloc(sb);
-		spi->i_addr[0] = blk;
+		blk = sp_block_alloc(sb, sp_inode_goal(inode));
+		sp_dmap_set(spi, 0, blk);	/* can't fail, the map is empty */
 		bh = sb_bread(sb, blk);
-		memset(bh->b_data, 0, SP_BSIZE);
+		memset(bh->b_data, 0, sb->s_blocksize);
 		dirent = (struct sp_dirent *)bh->b_data;
 		dirent->d_ino = inum;
 		strcpy(dirent->d_name, ".");
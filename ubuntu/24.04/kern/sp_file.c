@@ -7,159 +7,1046 @@
  */
 
 #include <linux/fs.h>
-#include <linux/mpage.h>
-#include <linux/buffer_head.h>
+#include <linux/iomap.h>
+#include <linux/falloc.h>
 #include "spfs.h"
 
-struct file_operations sp_file_operations = {
-	.fsync			= generic_file_fsync,
-	.llseek			= generic_file_llseek,
-	.read_iter		= generic_file_read_iter,
-	.write_iter		= generic_file_write_iter,
-	.mmap			= generic_file_mmap,
-	.unlocked_ioctl	= sp_ioctl
-};
 
 /*
- * Called when reading or writing to a regular file. If 'create' is set
- * we need to allocate a block if one does not exist already.
+ * Pick the physical block we'd like to use for logical block "block".
+ * That's the block following the nearest mapped block before it, so
+ * for a file being written sequentially it's the block right after
+ * the one backing block - 1. Past the direct blocks we only look at
+ * block - 1 before falling back to the direct blocks. If there's no 
+ * mapped block before "block" we start in the inode's allocation 
+ * group. Called with i_map_lock held.
+ */
+
+static int
+sp_find_goal(struct inode *inode, sector_t block)
+{
+	struct sp_inode_info	*spi = ITOSPI(inode);
+	int						i, blk;
+
+	if (block > SP_DIRECT_BLOCKS && 
+		sp_map_read(inode, block - 1, &blk) == 0 && sp_addr_block(blk)) {
+		return sp_addr_block(blk) + 1;
+	}
+	i = (int)min_t(sector_t, block, SP_DIRECT_BLOCKS);
+	for (i = i - 1 ; i >= 0 ; i--) {
+		blk = sp_addr_block(sp_dmap_get(spi, i));
+		if (blk) {
+			return blk + (block - i);
+		}
+	}
+	return sp_inode_goal(inode);
+}
+
+/*
+ * Count the map entries starting at "block", up to "max", that carry 
+ * on the run begun by entry "addr". Each entry must be "step" more 
+ * than the one before: 1 for blocks that are contiguous on disk, 0 for
+ * a run of holes or delayed allocations. Called with i_map_lock held.
+ */
+
+static unsigned int
+sp_map_run(struct inode *inode, sector_t block, int addr, int step,
+           unsigned int max)
+{
+	unsigned int			count;
+	int						next;
+
+	for (count = 1 ; count < max ; count++) {
+		if (sp_map_read(inode, block + count, &next) != 0 ||
+			next != addr + step * (int)count) {
+			break;
+		}
+	}
+	return count;
+}
+
+/*
+ * Allocate disk blocks for the "*count" logical blocks starting at
+ * "block". The entries must all be holes or all be delayed allocations.
+ * We try to get one contiguous run of blocks but may get fewer than
+ * asked for. "*count" is set to the number allocated and the first
+ * disk block is returned, or 0 if we're out of space. The new entries
+ * have "flags" (SP_ADDR_UNWRITTEN or 0) set in them.
+ *
+ * Delayed allocations already have space reserved. We allocate against
+ * the reservation, so nobody else can take the blocks meanwhile, and 
+ * then give back the reservation for the blocks we got. Whatever we
+ * didn't get stays reserved. Past the direct blocks, an indirect block
+ * may have to be allocated to hold the new entries, or the direct map
+ * may need more room. If that fails we keep the part of the run that
+ * was mapped. Called with i_map_lock held.
  */
 
-int
-sp_get_block(struct inode *inode, sector_t block, 
-             struct buffer_head *bh_result, int create)
+static int
+sp_alloc_blocks(struct inode *inode, sector_t block, unsigned int *count,
+                int flags)
 {
-	unsigned long			phys;
 	struct super_block		*sb = inode->i_sb;
 	struct sp_inode_info	*spi = ITOSPI(inode);
-	int						blk;
+	bool					delalloc;
+	int						blk, goal, i;
 
-	printk("spfs: sp_get_block (inode = %px, block = %d)\n", inode, (int)block);
+	delalloc = (block < SP_DIRECT_BLOCKS && 
+				sp_dmap_get(spi, block) == SP_DELALLOC_ADDR);
+	goal = sp_find_goal(inode, block);
+	if (delalloc) {
+		blk = sp_block_alloc_reserved(sb, goal, count);
+	} else {
+		blk = sp_block_alloc_range(sb, goal, count);
+	}
+	if (blk == 0) {
+		*count = 0;
+	}
+	for (i = 0 ; i < *count ; i++) {
+		if (sp_map_set(inode, block + i, (blk + i) | flags, 
+					   blk + *count) != 0) {
+			sp_block_free(sb, blk + i, *count - i);
+			*count = i;
+			break;
+		}
+	}
+	if (delalloc && *count) {
+		sp_release_blocks(sb, *count);
+	}
+	if (*count == 0) {
+		return 0;
+	}
+	spi->i_blocks += *count;
+	mark_inode_dirty(inode);
+	return blk;
+}
 
-	/*
-	 * Regardless of whether we're reading or writing, if the block
-     * requested exists, map it and return. On the read path, the 
-     * data will be read in. For writes, it will be read in and then
-     * modifications will be made to the page.
-	 */
+/*
+ * Clear the unwritten flag in the "*count" map entries from "block" 
+ * that have it, once data has been written to them. 
+ * "*count" is set to the number of entries dealt with before any 
+ * error. Called with i_map_lock held.
+ */
 
-    phys = spi->i_addr[block];
-    if (phys) {
-        map_bh(bh_result, sb, phys);
-        return 0;
-    }
+static int
+sp_map_written(struct inode *inode, sector_t block, unsigned int *count)
+{
+	unsigned int			i;
+	int						addr, error = 0;
 
-    /*
-     * If we're reading and don't have a block backing on disk,
-     * we must be reading over a hole. Leave that to the kernel.
-     */
+	for (i = 0 ; i < *count ; i++) {
+		error = sp_map_read(inode, block + i, &addr);
+		if (!error && sp_addr_unwritten(addr)) {
+			error = sp_map_set(inode, block + i, sp_addr_block(addr), 0);
+		}
+		if (error) {
+			break;
+		}
+	}
+	*count = i;
+	if (i) {
+		mark_inode_dirty(inode);
+	}
+	return error;
+}
 
-    if (!create) {
-        return 0;
-    }
+/*
+ * Describe the blocks of a file from "pos" for iomap. We return the 
+ * run of blocks starting at "pos", up to "length" bytes, that are all
+ * in the same state: written and contiguous on disk (IOMAP_MAPPED), 
+ * unwritten (IOMAP_UNWRITTEN), waiting on delayed allocation 
+ * (IOMAP_DELALLOC) or holes (IOMAP_HOLE). That's all reads, zeroing
+ * and reporting need. Delayed allocations and unwritten blocks read 
+ * back as zeros just as holes do.
+ *
+ * Writes (IOMAP_WRITE) must have somewhere to put the data:
+ *
+ *  - Unwritten blocks stay unwritten and are returned as 
+ *    IOMAP_UNWRITTEN so iomap zeroes the parts of them not being 
+ *    written rather than reading them from disk. They're only flagged
+ *    as written once the data is on disk (writeback below).
+ *  - When mounted with "delalloc", holes in the direct blocks just 
+ *    have space reserved and become IOMAP_DELALLOC. IOMAP_F_NEW tells
+ *    sp_iomap_end() that the reservation is ours to give back if the 
+ *    write comes up short.
+ *  - Otherwise holes get a contiguous run of blocks, as large as we 
+ *    can get, marked unwritten. They're IOMAP_UNWRITTEN and IOMAP_F_NEW
+ *    so a short write can free the ones it didn't get to. Past the 
+ *    direct blocks, holes are always allocated.
+ *
+ * Zeroing (IOMAP_ZERO) only has to deal with blocks that have data so
+ * holes, unwritten blocks and delayed allocations are returned as they
+ * are, without reserving or allocating anything.
+ *
+ * Direct I/O (IOMAP_DIRECT) has no pages to hold delayed allocations
+ * so direct writes always allocate, marking the new blocks unwritten.
+ * Unwritten blocks are only converted when the write completes (see
+ * sp_dio_write_end_io()) so nobody can read the block before the data
+ * is there. Direct reads see delayed allocations as holes. 
+ * IOMAP_F_DIRTY tells iomap that a direct write changes metadata (the
+ * block map or i_size) so O_DSYNC must sync the inode rather than 
+ * just use FUA.
+ *
+ * Writeback ("writeback" set) allocates delayed allocations, as 
+ * unwritten blocks. We take the whole run of them, not just what's 
+ * being written, so that a file written in pieces still ends up 
+ * contiguous. Other runs are returned whole too so writeback can reuse
+ * the mapping for the folios that follow. Unwritten blocks are only 
+ * flagged as written when the write of their data completes (see 
+ * sp_end_bio()), and only the blocks that were written.
+ */
 
-	/*
-	 * We're writing. First check to see is the file can be extended.
-	 */
+static int
+sp_iomap_map(struct inode *inode, loff_t pos, loff_t length, unsigned flags,
+             struct iomap *iomap, bool writeback)
+{
+	struct super_block		*sb = inode->i_sb;
+	struct sp_inode_info	*spi = ITOSPI(inode);
+	sector_t				block = pos >> inode->i_blkbits;
+	unsigned int			max, all, count;
+	u16						type, iflags = 0;
+	bool					direct = flags & IOMAP_DIRECT;
+	int						blk, i, error;
 
-	if (block >= SP_DIRECT_BLOCKS) {
+	if (block >= SP_FILE_BLOCKS(sb->s_blocksize)) {
 		return -EFBIG;
 	}
+	all = SP_FILE_BLOCKS(sb->s_blocksize) - block;
+	max = min_t(u64, ((pos + length - 1) >> inode->i_blkbits) - block + 1, 
+				all);
+
+	mutex_lock(&spi->i_map_lock);
+	error = sp_map_read(inode, block, &blk);
+	if (error) {
+		goto out;
+	}
+	if (blk > 0) {
+		type = IOMAP_MAPPED;
+		count = sp_map_run(inode, block, blk, 1, writeback ? all : max);
+	} else if (sp_addr_unwritten(blk)) {
+		type = IOMAP_UNWRITTEN;
+		count = sp_map_run(inode, block, blk, 1, writeback ? all : max);
+	} else if (blk == SP_DELALLOC_ADDR) {
+		type = IOMAP_DELALLOC;
+		count = sp_map_run(inode, block, blk, 0, writeback ? all : max);
+	} else {
+		type = IOMAP_HOLE;
+		count = sp_map_run(inode, block, blk, 0, max);
+	}
+	if (type == IOMAP_DELALLOC && direct && !(flags & IOMAP_WRITE)) {
+		type = IOMAP_HOLE;
+	}
+	if (direct && (flags & IOMAP_WRITE) && 
+		(type == IOMAP_UNWRITTEN || pos + length > i_size_read(inode))) {
+		iflags |= IOMAP_F_DIRTY;
+	}
+	if (!(flags & IOMAP_WRITE) || (flags & IOMAP_ZERO) || 
+		type == IOMAP_MAPPED) {
+		goto out;
+	}
 
-	/*
-	 * We must allocate a new block. Assuming we get a block, we map it 
-     * and specify that the buffer is new which will avoid the kernel 
-     * reading it data from disk.
-	 */
-
-    blk = sp_block_alloc(sb);
-    if (blk == 0) {
-        printk("spfs: sp_get_block - out of space\n");
-        return -ENOSPC;
-    }
-    printk("spfs: sp_get_block - allocated blk=%d \n", blk);
-    spi->i_addr[block] = blk;
-    spi->i_blocks++;
-    mark_inode_dirty(inode);
-    set_buffer_new(bh_result);
-    map_bh(bh_result, sb, blk);
+	if (type == IOMAP_UNWRITTEN) {
+		goto out;
+	}
+	if (type == IOMAP_DELALLOC && !writeback && !direct) {
+		goto out;
+	}
+	if (type == IOMAP_HOLE && !writeback && !direct && 
+		block < SP_DIRECT_BLOCKS && sp_test_opt(sb, DELALLOC)) {
+		count = min_t(unsigned int, count, SP_DIRECT_BLOCKS - block);
+		error = sp_reserve_blocks(sb, count);
+		if (error) {
+			goto out;
+		}
+		for (i = 0 ; i < count ; i++) {
+			error = sp_dmap_set(spi, block + i, SP_DELALLOC_ADDR);
+			if (error) {
+				break;
+			}
+		}
+		if (i < count) {
+			sp_release_blocks(sb, count - i);
+		}
+		if (i == 0) {
+			goto out;
+		}
+		count = i;
+		error = 0;
+		type = IOMAP_DELALLOC;
+		iflags |= IOMAP_F_NEW;
+		goto out;
+	}
+	blk = sp_alloc_blocks(inode, block, &count, SP_ADDR_UNWRITTEN);
+	if (blk == 0) {
+		printk("spfs: sp_iomap_map - out of space\n");
+		error = -ENOSPC;
+		goto out;
+	}
+	type = IOMAP_UNWRITTEN;
+	iflags |= IOMAP_F_NEW | IOMAP_F_DIRTY;
 
+out:
+	mutex_unlock(&spi->i_map_lock);
+	if (error) {
+		return error;
+	}
+	iomap->bdev = sb->s_bdev;
+	iomap->offset = (loff_t)block << inode->i_blkbits;
+	iomap->length = (u64)count << inode->i_blkbits;
+	iomap->type = type;
+	iomap->flags = iflags;
+	if (type == IOMAP_MAPPED || type == IOMAP_UNWRITTEN) {
+		iomap->addr = (u64)sp_addr_block(blk) << inode->i_blkbits;
+	} else {
+		iomap->addr = IOMAP_NULL_ADDR;
+	}
 	return 0;
 }
 
-void
-sp_write_failed(struct address_space *mapping, loff_t to)
+static int
+sp_iomap_begin(struct inode *inode, loff_t pos, loff_t length, unsigned flags,
+               struct iomap *iomap, struct iomap *srcmap)
 {
-    struct inode *inode = mapping->host;
+	return sp_iomap_map(inode, pos, length, flags, iomap, false);
+}
+
+/*
+ * Give back the reservations for delayed allocations that a short 
+ * write didn't use. Only blocks with no dirty data in the page cache
+ * get here.
+ */
 
-	printk("spfs: sp_write_failed for inode=%px\n", inode);
-    if (to > inode->i_size) {
-        truncate_pagecache(inode, inode->i_size);
+static int
+sp_punch_delalloc(struct inode *inode, loff_t offset, loff_t length)
+{
+	struct sp_inode_info	*spi = ITOSPI(inode);
+	sector_t				block, end;
+	int						error = 0;
+
+	block = offset >> inode->i_blkbits;
+	end = min_t(sector_t, (offset + length - 1) >> inode->i_blkbits, 
+				SP_DIRECT_BLOCKS - 1);
+	mutex_lock(&spi->i_map_lock);
+	for ( ; block <= end ; block++) {
+		if (sp_dmap_get(spi, block) != SP_DELALLOC_ADDR) {
+			continue;
+		}
+		error = sp_dmap_set(spi, block, 0);
+		if (error) {
+			break;
+		}
+		sp_release_blocks(inode->i_sb, 1);
 	}
+	mutex_unlock(&spi->i_map_lock);
+	return error;
 }
 
-int
-sp_write_begin(struct file *file, struct address_space *mapping,
-			   loff_t pos, unsigned len, struct page **pagep, void **fsdata)
+/*
+ * Free the blocks that a short buffered write allocated but didn't 
+ * write anything to. They're the tail of the run in "iomap", from the
+ * block after the last byte written (or the first block if nothing 
+ * was).
+ */
+
+static int
+sp_free_unused(struct inode *inode, loff_t pos, ssize_t written, 
+			   struct iomap *iomap)
 {
-	struct inode	*inode	= mapping->host;
-    int				ret;
+	struct sp_inode_info	*spi = ITOSPI(inode);
+	loff_t					bsize = 1 << inode->i_blkbits;
+	sector_t				block, end;
+	int						blk, i, error = 0;
+
+	if (written) {
+		block = (pos + written + bsize - 1) >> inode->i_blkbits;
+	} else {
+		block = pos >> inode->i_blkbits;
+	}
+	end = (iomap->offset + iomap->length) >> inode->i_blkbits;
+	if (block >= end) {
+		return 0;
+	}
+	blk = (iomap->addr >> inode->i_blkbits) + 
+		  (block - (iomap->offset >> inode->i_blkbits));
+	mutex_lock(&spi->i_map_lock);
+	for (i = 0 ; block + i < end ; i++) {
+		error = sp_map_set(inode, block + i, 0, 0);
+		if (error) {
+			break;
+		}
+	}
+	if (i) {
+		sp_block_free(inode->i_sb, blk, i);
+		spi->i_blocks -= i;
+		mark_inode_dirty(inode);
+	}
+	mutex_unlock(&spi->i_map_lock);
+	return error;
+}
 
-	printk("spfs: sp_write_begin for inode=%px, off=%lld, len=%d\n",
-		   inode, pos, len);
-    ret = block_write_begin(mapping, pos, len, pagep, sp_get_block);
-    if (unlikely(ret)) {
-        sp_write_failed(mapping, pos + len);
+static int
+sp_iomap_end(struct inode *inode, loff_t pos, loff_t length, ssize_t written,
+             unsigned flags, struct iomap *iomap)
+{
+	if (!(flags & IOMAP_WRITE) || !(iomap->flags & IOMAP_F_NEW) || 
+		written >= length) {
+		return 0;
 	}
-	printk("spfs: sp_write_begin got page=%px\n", *pagep);
-    return ret;
+	if (iomap->type == IOMAP_DELALLOC) {
+		return iomap_file_buffered_write_punch_delalloc(inode, iomap, pos,
+					length, written, sp_punch_delalloc);
+	}
+	if (flags & IOMAP_DIRECT) {
+		return 0;
+	}
+	return sp_free_unused(inode, pos, written, iomap);
+}
+
+const struct iomap_ops sp_iomap_ops = {
+	.iomap_begin	= sp_iomap_begin,
+	.iomap_end		= sp_iomap_end,
+};
+
+/*
+ * Flag the blocks under "size" bytes at "pos" as written now that the
+ * data is on disk.
+ */
+
+static int
+sp_convert_unwritten(struct inode *inode, loff_t pos, ssize_t size)
+{
+	struct sp_inode_info	*spi = ITOSPI(inode);
+	sector_t				block = pos >> inode->i_blkbits;
+	unsigned int			count;
+	int						error;
+
+	count = ((pos + size - 1) >> inode->i_blkbits) - block + 1;
+	mutex_lock(&spi->i_map_lock);
+	error = sp_map_written(inode, block, &count);
+	mutex_unlock(&spi->i_map_lock);
+	return error;
 }
 
-int
-sp_write_end(struct file *file, struct address_space *mapping,
-			 loff_t pos, unsigned len, unsigned copied,
-			 struct page *page, void *fsdata)
+/*
+ * Writeback of unwritten blocks. iomap gathers them into ioends of 
+ * their own (IOMAP_UNWRITTEN) and we point the bio of each one at 
+ * sp_end_bio(). That runs at interrupt time so it hands the ioend to 
+ * sp_ioend_worker() which flags the blocks as written, if the write 
+ * worked, and then lets iomap end writeback on the folios.
+ */
+
+void
+sp_ioend_worker(struct work_struct *work)
 {
-	struct inode	*inode	= mapping->host;
-    int				error;
+	struct spfs_sb_info		*sbi = container_of(work, struct spfs_sb_info,
+												s_ioend_work);
+	struct iomap_ioend		*ioend;
+	LIST_HEAD(list);
+	int						error;
 
-	printk("spfs: sp_write_end for inode=%px, off=%lld, len=%d, page=%px\n",
-		   inode, pos, len, page);
-	error = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
-    return error;
+	spin_lock_irq(&sbi->s_ioend_lock);
+	list_splice_init(&sbi->s_ioend_list, &list);
+	spin_unlock_irq(&sbi->s_ioend_lock);
+
+	while ((ioend = list_first_entry_or_null(&list, struct iomap_ioend, 
+											 io_list))) {
+		list_del_init(&ioend->io_list);
+		error = blk_status_to_errno(ioend->io_bio->bi_status);
+		if (!error) {
+			error = sp_convert_unwritten(ioend->io_inode, ioend->io_offset,
+										 ioend->io_size);
+		}
+		iomap_finish_ioends(ioend, error);
+	}
 }
 
-static int sp_writepages(struct address_space *mapping,
-                         struct writeback_control *wbc)
+static void
+sp_end_bio(struct bio *bio)
 {
-    return mpage_writepages(mapping, wbc, sp_get_block);
+	struct iomap_ioend		*ioend = bio->bi_private;
+	struct spfs_sb_info		*sbi = SBTOSPFSSB(ioend->io_inode->i_sb);
+	unsigned long			flags;
+
+	spin_lock_irqsave(&sbi->s_ioend_lock, flags);
+	list_add_tail(&ioend->io_list, &sbi->s_ioend_list);
+	spin_unlock_irqrestore(&sbi->s_ioend_lock, flags);
+	schedule_work(&sbi->s_ioend_work);
 }
 
-int
+static int
+sp_prepare_ioend(struct iomap_ioend *ioend, int status)
+{
+	if (!status && ioend->io_type == IOMAP_UNWRITTEN) {
+		ioend->io_bio->bi_end_io = sp_end_bio;
+	}
+	return status;
+}
+
+/*
+ * Writeback. The mapping from the last call is reused while it still
+ * covers the folio being written.
+ */
+
+static int
+sp_map_blocks(struct iomap_writepage_ctx *wpc, struct inode *inode,
+              loff_t offset, unsigned len)
+{
+	if (offset >= wpc->iomap.offset &&
+		offset < wpc->iomap.offset + wpc->iomap.length) {
+		return 0;
+	}
+	return sp_iomap_map(inode, offset, len, IOMAP_WRITE, &wpc->iomap, true);
+}
+
+static const struct iomap_writeback_ops sp_writeback_ops = {
+	.map_blocks		= sp_map_blocks,
+	.prepare_ioend	= sp_prepare_ioend,
+};
+
+static int
+sp_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+	struct iomap_writepage_ctx	wpc = { };
+
+	return iomap_writepages(mapping, wbc, &wpc, &sp_writeback_ops);
+}
+
+static int
 sp_read_folio(struct file *file, struct folio *folio)
 {
-	printk("spfs: sp_read_folio\n");
-    return block_read_full_folio(folio, sp_get_block);
+	return iomap_read_folio(folio, &sp_iomap_ops);
 }
 
-sector_t
+/*
+ * Readahead. iomap maps each run of blocks once and adds the folios
+ * that fall in it to one bio, so a sequential read of a contiguous
+ * file turns into a few large reads rather than one per folio.
+ */
+
+static void
+sp_readahead(struct readahead_control *rac)
+{
+	iomap_readahead(rac, &sp_iomap_ops);
+}
+
+static sector_t
 sp_bmap(struct address_space *mapping, sector_t block)
-{   
-	printk("spfs: sp_bmap for sector=%lld\n", block);
-	return generic_block_bmap(mapping, block, sp_get_block);
+{
+	return iomap_bmap(mapping, block, &sp_iomap_ops);
 }
 
 struct address_space_operations sp_aops = {
-	.dirty_folio		= block_dirty_folio,
-	.invalidate_folio	= block_invalidate_folio,
-	.read_folio			= sp_read_folio,
-	.writepages			= sp_writepages,
-	.write_begin		= sp_write_begin,
-	.write_end			= sp_write_end,
-	.bmap				= sp_bmap
+	.read_folio				= sp_read_folio,
+	.readahead				= sp_readahead,
+	.writepages				= sp_writepages,
+	.dirty_folio			= iomap_dirty_folio,
+	.release_folio			= iomap_release_folio,
+	.invalidate_folio		= iomap_invalidate_folio,
+	.is_partially_uptodate	= iomap_is_partially_uptodate,
+	.migrate_folio			= filemap_migrate_folio,
+	.bmap					= sp_bmap
 };
 
+/*
+ * O_DIRECT. iomap builds bios straight from the user's buffer with 
+ * the mapping from sp_iomap_map(). Direct reads only take i_rwsem 
+ * shared so they run in parallel with each other. Direct writes that
+ * extend the file are waited for so i_size is only changed (here, at
+ * completion) with the inode locked. Unwritten blocks that a write 
+ * went to (IOMAP_DIO_UNWRITTEN) are converted here too, once the data
+ * is on disk, and stay unwritten if the write failed.
+ */
+
+static int
+sp_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error, 
+                    unsigned flags)
+{
+	struct inode	*inode = file_inode(iocb->ki_filp);
+
+	if (error) {
+		return error;
+	}
+	if (size && (flags & IOMAP_DIO_UNWRITTEN)) {
+		error = sp_convert_unwritten(inode, iocb->ki_pos, size);
+		if (error) {
+			return error;
+		}
+	}
+	if (size && iocb->ki_pos + size > i_size_read(inode)) {
+		i_size_write(inode, iocb->ki_pos + size);
+		mark_inode_dirty(inode);
+	}
+	return 0;
+}
+
+static const struct iomap_dio_ops sp_dio_write_ops = {
+	.end_io		= sp_dio_write_end_io,
+};
+
+static ssize_t
+sp_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode	*inode = file_inode(iocb->ki_filp);
+	ssize_t			ret;
+
+	if (!(iocb->ki_flags & IOCB_DIRECT)) {
+		return generic_file_read_iter(iocb, to);
+	}
+	if (!iov_iter_count(to)) {
+		return 0;
+	}
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!inode_trylock_shared(inode)) {
+			return -EAGAIN;
+		}
+	} else {
+		inode_lock_shared(inode);
+	}
+	ret = iomap_dio_rw(iocb, to, &sp_iomap_ops, NULL, 0, NULL, 0);
+	inode_unlock_shared(inode);
+	file_accessed(iocb->ki_filp);
+	return ret;
+}
+
+/*
+ * write(2). iomap does the page cache work and calls back into 
+ * sp_iomap_begin() for each run of blocks. It updates i_size but 
+ * leaves it to us to get the inode written. iomap does the O_SYNC 
+ * work for direct writes.
+ *
+ * A direct write that doesn't cover whole blocks has iomap zero the 
+ * rest of them, which would race with another unaligned AIO write to 
+ * the same block, so we wait for those to finish first and don't 
+ * let this one run async either. Writes past EOF wait too, i_size 
+ * being updated at completion. If a direct write can't invalidate the
+ * page cache over the range (-ENOTBLK) we fall back to a buffered 
+ * write, then write it back and drop it from the cache so that it's 
+ * still on disk, and not cached, as O_DIRECT promised.
+ */
+
+static ssize_t
+sp_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct inode	*inode = file_inode(iocb->ki_filp);
+	unsigned int	dio_flags = 0;
+	bool			direct = false;
+	loff_t			pos;
+	loff_t			size;
+	ssize_t			ret;
+	int				error;
+
+	inode_lock(inode);
+	size = i_size_read(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0) {
+		goto out;
+	}
+	ret = file_modified(iocb->ki_filp);
+	if (ret) {
+		goto out;
+	}
+	pos = iocb->ki_pos;
+	if (iocb->ki_flags & IOCB_DIRECT) {
+		if ((pos | iov_iter_count(from)) & (inode->i_sb->s_blocksize - 1)) {
+			inode_dio_wait(inode);
+			dio_flags |= IOMAP_DIO_FORCE_WAIT;
+		}
+		if (pos + iov_iter_count(from) > size) {
+			dio_flags |= IOMAP_DIO_FORCE_WAIT;
+		}
+		ret = iomap_dio_rw(iocb, from, &sp_iomap_ops, &sp_dio_write_ops,
+						   dio_flags, NULL, 0);
+		if (ret != -ENOTBLK) {
+			direct = true;
+			goto out;
+		}
+	}
+	ret = iomap_file_buffered_write(iocb, from, &sp_iomap_ops);
+	if (ret > 0 && (iocb->ki_flags & IOCB_DIRECT)) {
+		error = filemap_write_and_wait_range(inode->i_mapping, pos, 
+											 pos + ret - 1);
+		if (error) {
+			ret = error;
+			goto out;
+		}
+		invalidate_mapping_pages(inode->i_mapping, pos >> PAGE_SHIFT,
+								 (pos + ret - 1) >> PAGE_SHIFT);
+	}
+out:
+	if (i_size_read(inode) != size) {
+		mark_inode_dirty(inode);
+	}
+	inode_unlock(inode);
+	if (ret > 0 && !direct) {
+		ret = generic_write_sync(iocb, ret);
+	}
+	return ret;
+}
+
+/*
+ * A shared writable mapping is about to dirty a folio. Map it for 
+ * writing now, as write(2) would, so that space is reserved (or 
+ * allocated) and ENOSPC is a SIGBUS here rather than lost data later.
+ */
+
+static vm_fault_t
+sp_page_mkwrite(struct vm_fault *vmf)
+{
+	struct inode	*inode = file_inode(vmf->vma->vm_file);
+	vm_fault_t		ret;
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vmf->vma->vm_file);
+	filemap_invalidate_lock_shared(inode->i_mapping);
+	ret = iomap_page_mkwrite(vmf, &sp_iomap_ops);
+	filemap_invalidate_unlock_shared(inode->i_mapping);
+	sb_end_pagefault(inode->i_sb);
+	return ret;
+}
+
+static const struct vm_operations_struct sp_file_vm_ops = {
+	.fault			= filemap_fault,
+	.map_pages		= filemap_map_pages,
+	.page_mkwrite	= sp_page_mkwrite,
+};
+
+/*
+ * O_DIRECT is allowed since the data path goes through iomap.
+ */
+
+static int
+sp_file_open(struct inode *inode, struct file *file)
+{
+	file->f_mode |= FMODE_CAN_ODIRECT;
+	return generic_file_open(inode, file);
+}
+
+static int
+sp_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &sp_file_vm_ops;
+	return 0;
+}
+
+/*
+ * Fill every hole from "block" up to (but not including) "end" with 
+ * blocks that are marked unwritten in the block map so reads of them 
+ * return zeros without going to disk. Writing back the first write to
+ * an unwritten block converts it (see sp_iomap_map()). Blocks are 
+ * allocated in runs as large as we can get so files that are 
+ * preallocated up front end up contiguous.
+ */
+
+static int
+sp_prealloc(struct inode *inode, sector_t block, sector_t end)
+{
+	struct sp_inode_info	*spi = ITOSPI(inode);
+	unsigned int			count;
+	int						addr, blk, error = 0;
+
+	mutex_lock(&spi->i_map_lock);
+	for ( ; block < end ; block += count) {
+		count = 1;
+		error = sp_map_read(inode, block, &addr);
+		if (error) {
+			break;
+		}
+		if (addr != 0) {
+			continue;
+		}
+		count = sp_map_run(inode, block, 0, 0, end - block);
+		blk = sp_alloc_blocks(inode, block, &count, SP_ADDR_UNWRITTEN);
+		if (blk == 0) {
+			error = -ENOSPC;
+			break;
+		}
+	}
+	mutex_unlock(&spi->i_map_lock);
+	return error;
+}
+
+/*
+ * Zero "len" bytes at "pos" which all lie within one block. There's
+ * only something to do if the block has data on disk since holes and
+ * unwritten blocks read back as zeros anyway, and iomap skips those.
+ * The zeros are written back like any other write.
+ */
+
+static int
+sp_zero_partial(struct inode *inode, loff_t pos, loff_t len)
+{
+	if (len <= 0 || pos >= i_size_read(inode)) {
+		return 0;
+	}
+	len = min(len, i_size_read(inode) - pos);
+	return iomap_zero_range(inode, pos, len, NULL, &sp_iomap_ops);
+}
+
+/*
+ * Throw away the data in a range of a file. Partial blocks at either 
+ * end are zeroed through the page cache. Whole blocks are dropped from
+ * the page cache and then either freed, leaving a hole (punch), or 
+ * kept but flagged unwritten so they read back as zeros (zero range). 
+ * The range is written back first so there are no delayed allocations
+ * or dirty pages left in it. Emptied indirect blocks are kept. Called 
+ * with the inode locked.
+ */
+
+static int
+sp_clear_range(struct inode *inode, loff_t offset, loff_t len, bool unwritten)
+{
+	struct super_block		*sb = inode->i_sb;
+	struct address_space	*mapping = inode->i_mapping;
+	struct sp_inode_info	*spi = ITOSPI(inode);
+	loff_t					bsize = 1 << inode->i_blkbits;
+	loff_t					start, end;
+	sector_t				block, last;
+	unsigned int			count;
+	int						blk, next, i, error;
+
+	error = filemap_write_and_wait_range(mapping, offset, offset + len - 1);
+	if (error) {
+		return error;
+	}
+	start = round_up(offset, bsize);
+	end = round_down(offset + len, bsize);
+	if (start > end) {
+		return sp_zero_partial(inode, offset, len);
+	}
+	error = sp_zero_partial(inode, offset, start - offset);
+	if (!error) {
+		error = sp_zero_partial(inode, end, offset + len - end);
+	}
+	if (error || start == end) {
+		return error;
+	}
+
+	filemap_invalidate_lock(mapping);
+	truncate_pagecache_range(inode, start, end - 1);
+	last = min_t(sector_t, end >> inode->i_blkbits, 
+				 SP_FILE_BLOCKS(inode->i_sb->s_blocksize));
+	mutex_lock(&spi->i_map_lock);
+	for (block = start >> inode->i_blkbits ; block < last ; block += count) {
+		count = 1;
+		error = sp_map_read(inode, block, &blk);
+		if (error) {
+			break;
+		}
+		if (blk == 0) {
+			continue;
+		}
+		if (blk == SP_DELALLOC_ADDR) {
+			error = sp_dmap_set(spi, block, 0);
+			if (error) {
+				break;
+			}
+			sp_release_blocks(sb, 1);
+			continue;
+		}
+		blk = sp_addr_block(blk);
+		if (unwritten) {
+			error = sp_map_set(inode, block, blk | SP_ADDR_UNWRITTEN, 0);
+			if (error) {
+				break;
+			}
+			continue;
+		}
+		while (block + count < last && 
+			   sp_map_read(inode, block + count, &next) == 0 &&
+			   sp_addr_block(next) == blk + count) {
+			count++;
+		}
+		for (i = 0 ; i < count ; i++) {
+			error = sp_map_set(inode, block + i, 0, 0);
+			if (error) {
+				break;
+			}
+		}
+		if (i) {
+			sp_block_free(sb, blk, i);
+			spi->i_blocks -= i;
+		}
+		if (error) {
+			break;
+		}
+	}
+	mutex_unlock(&spi->i_map_lock);
+	filemap_invalidate_unlock(mapping);
+	mark_inode_dirty(inode);
+	return error;
+}
+
+/*
+ * fallocate(2). Plain preallocation and FALLOC_FL_KEEP_SIZE fill the 
+ * holes in the range with unwritten blocks. FALLOC_FL_PUNCH_HOLE frees
+ * the blocks in the range. FALLOC_FL_ZERO_RANGE turns the blocks in 
+ * the range into unwritten blocks, allocating any that are missing,
+ * rather than writing zeros. Unless FALLOC_FL_KEEP_SIZE is given (it 
+ * always is for punching), the file size is extended to cover the range.
+ */
+
+static long
+sp_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+	struct inode			*inode = file_inode(file);
+	sector_t				block, end;
+	int						error = 0;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | 
+				 FALLOC_FL_ZERO_RANGE)) {
+		return -EOPNOTSUPP;
+	}
+	block = offset >> inode->i_blkbits;
+	end = (offset + len + (1 << inode->i_blkbits) - 1) >> inode->i_blkbits;
+	if (end > SP_FILE_BLOCKS(inode->i_sb->s_blocksize) && 
+		!(mode & FALLOC_FL_PUNCH_HOLE)) {
+		return -EFBIG;
+	}
+
+	inode_lock(inode);
+	inode_dio_wait(inode);
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		error = sp_clear_range(inode, offset, len, false);
+		goto out_time;
+	}
+	if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+		error = inode_newsize_ok(inode, offset + len);
+		if (error) {
+			goto out;
+		}
+	}
+	if (mode & FALLOC_FL_ZERO_RANGE) {
+		error = sp_clear_range(inode, offset, len, true);
+	}
+	if (!error) {
+		error = sp_prealloc(inode, block, end);
+	}
+	if (!error && !(mode & FALLOC_FL_KEEP_SIZE) && 
+		offset + len > i_size_read(inode)) {
+		i_size_write(inode, offset + len);
+	}
+out_time:
+	inode_set_ctime_current(inode);
+	mark_inode_dirty(inode);
+out:
+	inode_unlock(inode);
+	return error;
+}
+
+/*
+ * lseek(2). SEEK_HOLE and SEEK_DATA walk the block map through iomap
+ * so backup and copy tools can skip the holes in sparse files. Holes 
+ * are holes, written blocks and delayed allocations are data, and 
+ * unwritten blocks are holes unless the page cache has data for them.
+ * The inode lock is taken shared to keep the file size steady.
+ */
+
+static loff_t
+sp_file_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode			*inode = file_inode(file);
+
+	switch (whence) {
+		case SEEK_HOLE:
+			inode_lock_shared(inode);
+			offset = iomap_seek_hole(inode, offset, &sp_iomap_ops);
+			inode_unlock_shared(inode);
+			break;
+		case SEEK_DATA:
+			inode_lock_shared(inode);
+			offset = iomap_seek_data(inode, offset, &sp_iomap_ops);
+			inode_unlock_shared(inode);
+			break;
+		default:
+			return generic_file_llseek(file, offset, whence);
+	}
+	if (offset < 0) {
+		return offset;
+	}
+	return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+/*
+ * splice(2) and sendfile(2). Reads hand page cache folios straight to
+ * the pipe (O_DIRECT files get copied by the VFS instead) and writes
+ * go through sp_file_write_iter() so they reserve or allocate blocks 
+ * like any other write.
+ */
+
+struct file_operations sp_file_operations = {
+	.fsync			= generic_file_fsync,
+	.llseek			= sp_file_llseek,
+	.open			= sp_file_open,
+	.read_iter		= sp_file_read_iter,
+	.write_iter		= sp_file_write_iter,
+	.mmap			= sp_file_mmap,
+	.fallocate		= sp_fallocate,
+	.splice_read	= filemap_splice_read,
+	.splice_write	= iter_file_splice_write,
+	.unlocked_ioctl	= sp_ioctl
+};
+
+/*
+ * FIEMAP (filefrag(8)). iomap hands back each run of the block map as 
+ * one extent, so a contiguous file is reported as a single extent in 
+ * one call. Unwritten blocks and delayed allocations are flagged as 
+ * such and holes are left out.
+ */
+
+static int
+sp_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start,
+          u64 len)
+{
+	int						error;
+
+	inode_lock_shared(inode);
+	error = iomap_fiemap(inode, fieinfo, start, len, &sp_iomap_ops);
+	inode_unlock_shared(inode);
+	return error;
+}
+
+/*
+ * chmod(2), chown(2), truncate(2) and friends. When the size shrinks,
+ * the pages past the new end of file are thrown away and so are any 
+ * delayed allocations under them, giving their reservations back. 
+ * Otherwise they'd stay reserved until the inode was removed. Blocks
+ * already allocated past the new size are kept.
+ */
+
+static int
+sp_setattr(struct mnt_idmap *idmap, struct dentry *dentry, struct iattr *iattr)
+{
+	struct inode			*inode = d_inode(dentry);
+	loff_t					bsize = 1 << inode->i_blkbits;
+	loff_t					start;
+	int						error;
+
+	error = setattr_prepare(idmap, dentry, iattr);
+	if (error) {
+		return error;
+	}
+	if ((iattr->ia_valid & ATTR_SIZE) && 
+		iattr->ia_size != i_size_read(inode)) {
+		inode_dio_wait(inode);
+		filemap_invalidate_lock(inode->i_mapping);
+		truncate_setsize(inode, iattr->ia_size);
+		start = round_up(iattr->ia_size, bsize);
+		error = sp_punch_delalloc(inode, start, 
+								  (loff_t)SP_DIRECT_BLOCKS * bsize);
+		filemap_invalidate_unlock(inode->i_mapping);
+		if (error) {
+			return error;
+		}
+	}
+	setattr_copy(idmap, inode, iattr);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
 struct inode_operations sp_file_inops = {
-	.link	= sp_link,
-	.unlink	= sp_unlink,
+	.link		= sp_link,
+	.unlink		= sp_unlink,
+	.setattr	= sp_setattr,
+	.fiemap		= sp_fiemap,
 };
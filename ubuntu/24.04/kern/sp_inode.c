@@ -18,6 +18,9 @@
 #include <linux/uaccess.h>
 #include <linux/fs.h>
 #include <linux/writeback.h>
+#include <linux/percpu_counter.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
 #include <uapi/linux/mount.h>
 #include "spfs.h"
 
@@ -45,9 +48,9 @@ sp_find_entry(struct inode *dip, char *name)
 
     printk("spfs: sp_find_entry - looking for %s (dip = %px)\n", name, dip);
     for (blk=0 ; blk < spi->i_blocks ; blk++) {
-        bh = sb_bread(sb, spi->i_addr[blk]);
+        bh = sb_bread(sb, sp_dmap_get(spi, blk));
         dirent = (struct sp_dirent *)bh->b_data;
-        for (i=0 ; i < SP_DIRS_PER_BLOCK ; i++) {
+        for (i=0 ; i < SP_DIRS_PER_BLOCK(sb->s_blocksize) ; i++) {
             if (strcmp(dirent->d_name, name) == 0) {
                 brelse(bh);
                 printk("spfs: sp_find_entry - found inum %d for %s\n",
@@ -62,6 +65,536 @@ sp_find_entry(struct inode *dip, char *name)
     return 0;
 }
 
+/*
+ * The entry for "block", which lies in or just past extent "ext".
+ */
+
+static inline int
+sp_iext_addr(const struct sp_iext *ext, int block)
+{
+    if (ext->e_addr == SP_DELALLOC_ADDR) {
+        return SP_DELALLOC_ADDR;
+    }
+    return ext->e_addr + (block - ext->e_lblk);
+}
+
+/*
+ * Add "len" entries starting with "addr" for the blocks from "lblk" 
+ * to the end of the extent list "ext" which has "*next" extents in 
+ * use. They're merged into the last extent if they carry on from it.
+ * Runs must be added in block order. Holes (addr 0) and empty runs 
+ * take no room. Returns false if another extent is needed and there 
+ * isn't room for it.
+ */
+
+static bool
+sp_iext_add(struct sp_iext *ext, int *next, int lblk, int len, int addr)
+{
+    struct sp_iext      *last;
+
+    if (len == 0 || addr == 0) {
+        return true;
+    }
+    if (*next) {
+        last = &ext[*next - 1];
+        if (last->e_lblk + last->e_len == lblk && 
+            sp_iext_addr(last, lblk) == addr) {
+            last->e_len += len;
+            return true;
+        }
+    }
+    if (*next == SP_INLINE_EXTENTS) {
+        return false;
+    }
+    ext[*next].e_lblk = lblk;
+    ext[*next].e_len = len;
+    ext[*next].e_addr = addr;
+    (*next)++;
+    return true;
+}
+
+/*
+ * Return the direct map entry for "block".
+ */
+
+int
+sp_dmap_get(struct sp_inode_info *spi, int block)
+{
+    struct sp_iext      *ext;
+    int                 i;
+
+    if (spi->i_map) {
+        return spi->i_map[block];
+    }
+    for (i=0 ; i < spi->i_next ; i++) {
+        ext = &spi->i_ext[i];
+        if (block < ext->e_lblk) {
+            break;
+        }
+        if (block < ext->e_lblk + ext->e_len) {
+            return sp_iext_addr(ext, block);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Copy the whole direct map out into "addr" (SP_DIRECT_BLOCKS entries).
+ */
+
+void
+sp_dmap_copy(struct sp_inode_info *spi, int *addr)
+{
+    struct sp_iext      *ext;
+    int                 i, b;
+
+    if (spi->i_map) {
+        memcpy(addr, spi->i_map, SP_DIRECT_BLOCKS * sizeof(int));
+        return;
+    }
+    memset(addr, 0, SP_DIRECT_BLOCKS * sizeof(int));
+    for (i=0 ; i < spi->i_next ; i++) {
+        ext = &spi->i_ext[i];
+        for (b = ext->e_lblk ; b < ext->e_lblk + ext->e_len ; b++) {
+            addr[b] = sp_iext_addr(ext, b);
+        }
+    }
+}
+
+/*
+ * Switch the inode over to a full map array if it isn't already. 
+ * Once it has one, changes to the direct map can't fail.
+ */
+
+int
+sp_dmap_expand(struct sp_inode_info *spi)
+{
+    int                 *map;
+
+    if (spi->i_map) {
+        return 0;
+    }
+    map = kmalloc_array(SP_DIRECT_BLOCKS, sizeof(int), GFP_NOFS);
+    if (!map) {
+        return -ENOMEM;
+    }
+    sp_dmap_copy(spi, map);
+    spi->i_map = map;
+    spi->i_next = 0;
+    return 0;
+}
+
+/*
+ * Go back to inline extents, freeing the map array, if they're now
+ * enough to hold the map.
+ */
+
+void
+sp_dmap_compact(struct sp_inode_info *spi)
+{
+    struct sp_iext      ext[SP_INLINE_EXTENTS];
+    int                 i, next = 0;
+
+    if (!spi->i_map) {
+        return;
+    }
+    for (i=0 ; i < SP_DIRECT_BLOCKS ; i++) {
+        if (!sp_iext_add(ext, &next, i, 1, spi->i_map[i])) {
+            return;
+        }
+    }
+    kfree(spi->i_map);
+    spi->i_map = NULL;
+    memcpy(spi->i_ext, ext, sizeof(ext));
+    spi->i_next = next;
+}
+
+/*
+ * Set the direct map entry for "block" to "addr". The extent holding
+ * the block, if any, is split around it and the new entry is merged 
+ * with its neighbours where it carries on from them. If that needs 
+ * more than SP_INLINE_EXTENTS extents, the inode switches to a full 
+ * map array, which is the only way this can fail (-ENOMEM).
+ */
+
+int
+sp_dmap_set(struct sp_inode_info *spi, int block, int addr)
+{
+    struct sp_iext      ext[SP_INLINE_EXTENTS];
+    struct sp_iext      *e;
+    int                 i, end, next = 0, error;
+    bool                added = false, fits = true;
+
+    if (spi->i_map) {
+        spi->i_map[block] = addr;
+        return 0;
+    }
+    for (i=0 ; i < spi->i_next && fits ; i++) {
+        e = &spi->i_ext[i];
+        end = e->e_lblk + e->e_len;
+        if (!added && block < end) {
+            fits = sp_iext_add(ext, &next, e->e_lblk, 
+                               max(block - e->e_lblk, 0), e->e_addr) &&
+                   sp_iext_add(ext, &next, block, 1, addr);
+            if (block >= e->e_lblk) {
+                fits = fits && sp_iext_add(ext, &next, block + 1, 
+                                           end - block - 1, 
+                                           sp_iext_addr(e, block + 1));
+            } else {
+                fits = fits && sp_iext_add(ext, &next, e->e_lblk, 
+                                           e->e_len, e->e_addr);
+            }
+            added = true;
+            continue;
+        }
+        fits = sp_iext_add(ext, &next, e->e_lblk, e->e_len, e->e_addr);
+    }
+    if (!added && fits) {
+        fits = sp_iext_add(ext, &next, block, 1, addr);
+    }
+    if (!fits) {
+        error = sp_dmap_expand(spi);
+        if (!error) {
+            spi->i_map[block] = addr;
+        }
+        return error;
+    }
+    memcpy(spi->i_ext, ext, next * sizeof(struct sp_iext));
+    spi->i_next = next;
+    return 0;
+}
+
+/*
+ * Fill in the in-core block map "addr" from an on-disk inode which may
+ * use either the direct or the extent format.
+ */
+
+void
+sp_read_map(struct sp_inode *dip, int *addr)
+{
+    struct sp_extent    *ext;
+    __u32               lblk, len, pblk, i;
+    int                 n;
+
+    if (!(le32_to_cpu(dip->i_flags) & SP_INODE_EXTENTS)) {
+        for (i=0 ; i < SP_DIRECT_BLOCKS ; i++) {
+            addr[i] = le32_to_cpu(dip->i_addr[i]);
+        }
+        return;
+    }
+    memset(addr, 0, SP_DIRECT_BLOCKS * sizeof(int));
+    for (n=0 ; n < SP_MAX_EXTENTS ; n++) {
+        ext = &dip->i_extent[n];
+        lblk = le32_to_cpu(ext->e_lblk);
+        len = le32_to_cpu(ext->e_len);
+        pblk = le32_to_cpu(ext->e_pblk);
+        if (len == 0) {
+            break;
+        }
+        for (i=0 ; i < len && lblk + i < SP_DIRECT_BLOCKS ; i++) {
+            addr[lblk + i] = pblk + i;
+        }
+    }
+}
+
+/*
+ * Set up the in-core direct map of "spi" from an on-disk inode. We 
+ * build the inline extents straight from the disk map and only fall 
+ * back to a full map array if there are too many of them.
+ */
+
+static int
+sp_dmap_read(struct sp_inode_info *spi, struct sp_inode *dip)
+{
+    struct sp_extent    *ext;
+    __u32               lblk, len;
+    int                 i, n;
+
+    spi->i_next = 0;
+    if (!(le32_to_cpu(dip->i_flags) & SP_INODE_EXTENTS)) {
+        for (i=0 ; i < SP_DIRECT_BLOCKS ; i++) {
+            if (!sp_iext_add(spi->i_ext, &spi->i_next, i, 1, 
+                             le32_to_cpu(dip->i_addr[i]))) {
+                goto full;
+            }
+        }
+        return 0;
+    }
+    for (n=0 ; n < SP_MAX_EXTENTS ; n++) {
+        ext = &dip->i_extent[n];
+        lblk = le32_to_cpu(ext->e_lblk);
+        len = le32_to_cpu(ext->e_len);
+        if (len == 0 || lblk >= SP_DIRECT_BLOCKS) {
+            break;
+        }
+        len = min_t(__u32, len, SP_DIRECT_BLOCKS - lblk);
+        if (!sp_iext_add(spi->i_ext, &spi->i_next, lblk, len, 
+                         le32_to_cpu(ext->e_pblk))) {
+            goto full;
+        }
+    }
+    return 0;
+
+full:
+    spi->i_next = 0;
+    spi->i_map = kmalloc_array(SP_DIRECT_BLOCKS, sizeof(int), GFP_NOFS);
+    if (!spi->i_map) {
+        return -ENOMEM;
+    }
+    sp_read_map(dip, spi->i_map);
+    return 0;
+}
+
+/*
+ * Copy the in-core block map of "inode" into the on-disk inode. If the
+ * filesystem was made with extents (mkfs -e), the map is stored as 
+ * extents when it fits, so a file that is mostly contiguous takes a
+ * handful of entries rather than SP_DIRECT_BLOCKS. Otherwise, or if 
+ * the file is too fragmented, we use the direct format. Delayed 
+ * allocations aren't allocated yet so are written as holes. Called
+ * with i_map_lock held.
+ */
+
+static void
+sp_write_map(struct inode *inode, struct sp_inode *dip)
+{
+    struct sp_inode_info    *spi = ITOSPI(inode);
+    struct spfs_sb_info     *sbi = SBTOSPFSSB(inode->i_sb);
+    struct sp_extent        *ext;
+    __u32                   addr, lblk = 0, len = 0, pblk = 0;
+    int                     i, n = 0;
+
+    if (!(sbi->s_features & SP_FEATURE_EXTENTS)) {
+        goto direct;
+    }
+    memset(dip->i_addr, 0, sizeof(dip->i_addr));
+    for (i=0 ; i <= SP_DIRECT_BLOCKS ; i++) {
+        addr = (i < SP_DIRECT_BLOCKS) ? sp_dmap_get(spi, i) : 0;
+        if (addr == SP_DELALLOC_ADDR) {
+            addr = 0;
+        }
+        if (len && addr == pblk + len) {
+            len++;
+            continue;
+        }
+        if (len) {
+            if (n == SP_MAX_EXTENTS) {
+                goto direct;
+            }
+            ext = &dip->i_extent[n++];
+            ext->e_lblk = cpu_to_le32(lblk);
+            ext->e_len = cpu_to_le32(len);
+            ext->e_pblk = cpu_to_le32(pblk);
+            len = 0;
+        }
+        if (addr) {
+            lblk = i;
+            pblk = addr;
+            len = 1;
+        }
+    }
+    dip->i_flags = cpu_to_le32(le32_to_cpu(dip->i_flags) | SP_INODE_EXTENTS);
+    return;
+
+direct:
+    for (i=0 ; i<SP_DIRECT_BLOCKS ; i++) {
+        addr = sp_dmap_get(spi, i);
+        if (addr == SP_DELALLOC_ADDR) {
+            dip->i_addr[i] = 0;    /* not allocated yet */
+        } else {
+            dip->i_addr[i] = cpu_to_le32(addr);
+        }
+    }
+    dip->i_flags = cpu_to_le32(le32_to_cpu(dip->i_flags) & ~SP_INODE_EXTENTS);
+}
+
+/*
+ * Get the buffer for the indirect block whose address is in "*blkp" 
+ * and cache it in "*bhp". If there isn't a block yet and "create" is 
+ * set, a zeroed one is allocated near "goal" and "*blkp" is updated.
+ * Otherwise "*bhp" is left NULL. Called with i_map_lock held.
+ */
+
+static int
+sp_map_getblk(struct inode *inode, int *blkp, struct buffer_head **bhp,
+              int create, int goal)
+{
+    struct super_block      *sb = inode->i_sb;
+    struct buffer_head      *bh;
+    int                     blk = *blkp;
+
+    if (*bhp) {
+        return 0;
+    }
+    if (blk == 0) {
+        if (!create) {
+            return 0;
+        }
+        blk = sp_block_alloc(sb, goal);
+        if (blk == 0) {
+            return -ENOSPC;
+        }
+        bh = sb_getblk(sb, blk);
+        lock_buffer(bh);
+        memset(bh->b_data, 0, bh->b_size);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        mark_buffer_dirty_inode(bh, inode);
+        *blkp = blk;
+    } else {
+        bh = sb_bread(sb, blk);
+        if (!bh) {
+            printk("spfs: sp_map_getblk - unable to read block %d\n", blk);
+            return -EIO;
+        }
+    }
+    *bhp = bh;
+    return 0;
+}
+
+/*
+ * Find the indirect block holding the map entry for logical block 
+ * "block" (which is past the direct blocks). On return "*bhp" is its
+ * buffer and "*idx" the index of the entry in it. If the indirect 
+ * block doesn't exist, "*bhp" is NULL unless "create" is set in which
+ * case it's allocated. The buffers are cached in the in-core inode so
+ * sequential access only reads each indirect block once. Called with
+ * i_map_lock held.
+ */
+
+static int
+sp_map_path(struct inode *inode, sector_t block, int create, int goal,
+            struct buffer_head **bhp, int *idx)
+{
+    struct sp_inode_info    *spi = ITOSPI(inode);
+    unsigned int            bs = inode->i_sb->s_blocksize;
+    __le32                  *p;
+    int                     leaf, blk, ind, error;
+
+    *bhp = NULL;
+    block -= SP_DIRECT_BLOCKS;
+    if (block < SP_IND_BLOCKS(bs)) {
+        ind = spi->i_ind;
+        error = sp_map_getblk(inode, &spi->i_ind, &spi->i_indbh, 
+                              create, goal);
+        if (spi->i_ind != ind) {
+            mark_inode_dirty(inode);
+        }
+        *bhp = spi->i_indbh;
+        *idx = block;
+        return error;
+    }
+    block -= SP_IND_BLOCKS(bs);
+    if (block >= SP_DIND_BLOCKS(bs)) {
+        return -EFBIG;
+    }
+    ind = spi->i_dind;
+    error = sp_map_getblk(inode, &spi->i_dind, &spi->i_dindbh, create, goal);
+    if (spi->i_dind != ind) {
+        mark_inode_dirty(inode);
+    }
+    if (error || !spi->i_dindbh) {
+        return error;
+    }
+
+    /*
+     * Now the leaf. Only one is cached so switch if it's another one.
+     */
+
+    leaf = block / SP_ADDRS_PER_BLOCK(bs);
+    if (spi->i_leafbh && spi->i_leaf != leaf) {
+        brelse(spi->i_leafbh);
+        spi->i_leafbh = NULL;
+    }
+    p = (__le32 *)spi->i_dindbh->b_data;
+    blk = le32_to_cpu(p[leaf]);
+    error = sp_map_getblk(inode, &blk, &spi->i_leafbh, create, goal);
+    if (error) {
+        return error;
+    }
+    if (blk != le32_to_cpu(p[leaf])) {
+        p[leaf] = cpu_to_le32(blk);
+        mark_buffer_dirty_inode(spi->i_dindbh, inode);
+    }
+    spi->i_leaf = leaf;
+    *bhp = spi->i_leafbh;
+    *idx = block % SP_ADDRS_PER_BLOCK(bs);
+    return 0;
+}
+
+/*
+ * Return the map entry for logical block "block" in "*addr". This is
+ * the direct map entry for direct blocks and the entry in the indirect
+ * block for the rest. Blocks with no indirect block are holes. Called
+ * with i_map_lock held.
+ */
+
+int
+sp_map_read(struct inode *inode, sector_t block, int *addr)
+{
+    struct sp_inode_info    *spi = ITOSPI(inode);
+    struct buffer_head      *bh;
+    int                     idx, error;
+
+    *addr = 0;
+    if (block < SP_DIRECT_BLOCKS) {
+        *addr = sp_dmap_get(spi, block);
+        return 0;
+    }
+    if (block >= SP_FILE_BLOCKS(inode->i_sb->s_blocksize)) {
+        return 0;
+    }
+    error = sp_map_path(inode, block, 0, 0, &bh, &idx);
+    if (!error && bh) {
+        *addr = le32_to_cpu(((__le32 *)bh->b_data)[idx]);
+    }
+    return error;
+}
+
+/*
+ * Set the map entry for logical block "block" to "addr", allocating 
+ * any indirect blocks needed near "goal". The indirect block is marked
+ * dirty against the inode so fsync(2) writes it. Delayed allocations
+ * are never stored in indirect blocks. Called with i_map_lock held.
+ */
+
+int
+sp_map_set(struct inode *inode, sector_t block, int addr, int goal)
+{
+    struct sp_inode_info    *spi = ITOSPI(inode);
+    struct buffer_head      *bh;
+    int                     idx, error;
+
+    if (block < SP_DIRECT_BLOCKS) {
+        return sp_dmap_set(spi, block, addr);
+    }
+    if (block >= SP_FILE_BLOCKS(inode->i_sb->s_blocksize)) {
+        return -EFBIG;
+    }
+    error = sp_map_path(inode, block, addr != 0, goal, &bh, &idx);
+    if (error || !bh) {
+        return error;
+    }
+    ((__le32 *)bh->b_data)[idx] = cpu_to_le32(addr);
+    mark_buffer_dirty_inode(bh, inode);
+    return 0;
+}
+
+/*
+ * Drop the cached indirect block buffers when the inode goes away.
+ */
+
+void
+sp_map_release(struct sp_inode_info *spi)
+{
+    brelse(spi->i_indbh);
+    brelse(spi->i_dindbh);
+    brelse(spi->i_leafbh);
+    spi->i_indbh = NULL;
+    spi->i_dindbh = NULL;
+    spi->i_leafbh = NULL;
+}
+
 /*
  * Called internally by sp_fill_super() but generally from sp_lookup()
  * when reading a file that's not already in-core.
@@ -74,7 +607,7 @@ sp_read_inode(struct super_block *sb, unsigned long ino)
     struct sp_inode           *disk_ip;
     struct sp_inode_info      *spi;
     struct inode              *inode;
-    int                       i, block;
+    int                       block, error = -EIO;
 
     printk("spfs: sp_read_inode for ino=%d\n", (int)ino);
     inode = iget_locked(sb, ino);
@@ -108,6 +641,7 @@ sp_read_inode(struct super_block *sb, unsigned long ino)
         inode->i_op = &sp_file_inops;
         inode->i_fop = &sp_file_operations;
         inode->i_mapping->a_ops = &sp_aops;
+        mapping_set_large_folios(inode->i_mapping);
     } else if (S_ISLNK(disk_ip->i_mode)) {
         inode->i_op = &simple_symlink_inode_operations;
         memcpy(spi->i_symlink, (char *)disk_ip->i_addr, disk_ip->i_size);
@@ -125,10 +659,16 @@ sp_read_inode(struct super_block *sb, unsigned long ino)
     inode_set_mtime(inode, le32_to_cpu(disk_ip->i_mtime), 0);
     inode_set_atime(inode, le32_to_cpu(disk_ip->i_atime), 0);
 
-    for (i=0 ; i < SP_DIRECT_BLOCKS ; i++) {
-        spi->i_addr[i] = disk_ip->i_addr[i];
+    if (!S_ISLNK(inode->i_mode)) {
+        error = sp_dmap_read(spi, disk_ip);
+        if (error) {
+            brelse(bh);
+            goto out;
+        }
     }
     spi->i_blocks = disk_ip->i_blocks;
+    spi->i_ind = le32_to_cpu(disk_ip->i_ind);
+    spi->i_dind = le32_to_cpu(disk_ip->i_dind);
 
     brelse(bh);
     unlock_new_inode(inode);
@@ -140,7 +680,7 @@ sp_read_inode(struct super_block *sb, unsigned long ino)
 
 out:
     iget_failed(inode);
-    return ERR_PTR(-EIO);
+    return ERR_PTR(error);
 }
 
 /*
@@ -157,7 +697,7 @@ sp_write_inode(struct inode *inode, struct writeback_control *wbc)
     struct sp_inode         *dip;
     struct buffer_head      *bh;
     __u32                   blk;
-    int                     i, error = 0;
+    int                     error = 0;
 
     printk("spfs: sp_write_inode (ino=%ld)\n", inode->i_ino);
     blk = SP_INODE_BLOCK + ino;
@@ -175,17 +715,24 @@ sp_write_inode(struct inode *inode, struct writeback_control *wbc)
     dip->i_size = cpu_to_le32(inode->i_size);
     dip->i_nlink = cpu_to_le32(inode->i_nlink);
     dip->i_blocks = spi->i_blocks;
-    for (i=0 ; i<SP_DIRECT_BLOCKS ; i++) {
-        dip->i_addr[i] = cpu_to_le32(spi->i_addr[i]);
-    }
 
     /*
      * For symlinks we store the name in the disk block array
-     * since symlinks have no data blocks.
+     * since symlinks have no data blocks. The slot may have held a
+     * file before so clear anything that says how to read a map.
      */
 
     if (S_ISLNK(inode->i_mode)) {
         memcpy((char *)dip->i_addr, inode->i_link, inode->i_size);
+        dip->i_flags = 0;
+        dip->i_ind = 0;
+        dip->i_dind = 0;
+    } else {
+        mutex_lock(&spi->i_map_lock);
+        sp_write_map(inode, dip);
+        mutex_unlock(&spi->i_map_lock);
+        dip->i_ind = cpu_to_le32(spi->i_ind);
+        dip->i_dind = cpu_to_le32(spi->i_dind);
     }
     mark_buffer_dirty(bh);
     if (wbc->sync_mode == WB_SYNC_ALL) {
@@ -201,8 +748,11 @@ sp_write_inode(struct inode *inode, struct writeback_control *wbc)
 void
 sp_free_inode(struct inode *inode)
 {
+    struct sp_inode_info    *spi = ITOSPI(inode);
+
     printk("spfs: sp_free_inode (ino=%ld)\n", inode->i_ino);
-    kmem_cache_free(spfs_inode_cache, ITOSPI(inode));
+    kfree(spi->i_map);
+    kmem_cache_free(spfs_inode_cache, spi);
 }
 
 /*
@@ -214,28 +764,31 @@ sp_evict_inode(struct inode *inode)
 {
     struct sp_inode_info    *spi = ITOSPI(inode);
     struct super_block      *sb = inode->i_sb;
-    struct spfs_sb_info     *sbi = SBTOSPFSSB(sb);
-    int                     blkpos, i;
 
     printk("spfs: sp_evict_inode (ino=%ld, nlink=%d)\n",
            inode->i_ino, (int)inode->i_nlink);
     truncate_inode_pages_final(&inode->i_data);
     invalidate_inode_buffers(inode);
+    sp_map_release(spi);
     clear_inode(inode);
 
     if (inode->i_nlink) {  /* the file must really be gone otherwise ... */
         return;
     }
 
-    mutex_lock(&sbi->s_lock);
-    sbi->s_nifree++;
-    sbi->s_inode[inode->i_ino] = SP_INODE_FREE;
-    sbi->s_nbfree += spi->i_blocks;
-    for (i=0 ; i < spi->i_blocks ; i++) {
-        blkpos = spi->i_addr[i] - SP_FIRST_DATA_BLOCK;
-        sbi->s_block[blkpos] = SP_BLOCK_FREE;
+    sp_ifree(sb, inode->i_ino);
+
+    /*
+     * The blocks are freed in the background (see sp_free_worker()) so
+     * that removing a large file doesn't hold up unlink(2). Symlinks 
+     * keep their target where the block map would be so have no blocks
+     * to free. The indirect blocks are read by the worker.
+     */
+
+    if (S_ISLNK(inode->i_mode)) {
+        return;
     }
-    mutex_unlock(&sbi->s_lock);
+    sp_free_inode_blocks(inode);
 }
 
 /*
@@ -251,9 +804,10 @@ sp_put_super(struct super_block *sb)
     struct spfs_sb_info     *sbi = SBTOSPFSSB(sb);
     struct sp_superblock    *dsb;
     struct buffer_head      *bh;
-    int                     i;
 
     printk("spfs: sp_put_super\n");
+    flush_work(&sbi->s_ioend_work);
+    sp_flush_frees(sbi);
     bh = sb_bread(sb, 0);
     if (!bh) {
         printk("spfs: sp_put_super - failed to read superblock\n");
@@ -261,22 +815,24 @@ sp_put_super(struct super_block *sb)
     }
     dsb = (struct sp_superblock *)bh->b_data;
     dsb->s_mod = SP_FSCLEAN;
-    dsb->s_nifree = sbi->s_nifree;
-    dsb->s_nbfree = sbi->s_nbfree;
-    for (i=0 ; i<SP_MAXFILES ; i++) {
-        dsb->s_inode[i] = cpu_to_le32(sbi->s_inode[i]);
-    }
-    for (i=0 ; i<SP_MAXBLOCKS ; i++) {
-        dsb->s_block[i] = cpu_to_le16(sbi->s_block[i]);
-    }
-    mutex_destroy(&sbi->s_lock);
+    dsb->s_nifree = percpu_counter_sum_positive(&sbi->s_nifree);
+    dsb->s_nbfree = percpu_counter_sum_positive(&sbi->s_nbfree);
+    sp_write_imap(sbi, dsb);
+    sp_write_bmap(sbi, dsb);
+    percpu_counter_destroy(&sbi->s_nifree);
+    percpu_counter_destroy(&sbi->s_nbfree);
+    percpu_counter_destroy(&sbi->s_dirtyblocks);
+    free_percpu(sbi->s_hint);
     kfree(sbi);
     mark_buffer_dirty(bh);
     brelse(bh);
 }
 
 /*
- * This function is called by the df(1) command / statfs(2) system call
+ * This function is called by the df(1) command / statfs(2) system call.
+ * The free counts are approximate reads of the per-CPU counters so that
+ * we never contend with allocating or freeing threads. Blocks reserved
+ * for delayed allocation are reported as used.
  */
 
 int
@@ -284,15 +840,18 @@ sp_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
     struct super_block   *sb = dentry->d_sb;
     struct spfs_sb_info  *sbi = SBTOSPFSSB(sb);
+    s64                  bfree;
 
     printk("spfs: sp_statfs called for %s\n", dentry->d_name.name);
+    bfree = percpu_counter_read_positive(&sbi->s_nbfree) -
+            percpu_counter_read_positive(&sbi->s_dirtyblocks);
     buf->f_type = SP_MAGIC;
-    buf->f_bsize = SP_BSIZE;
+    buf->f_bsize = sb->s_blocksize;
     buf->f_blocks = SP_MAXBLOCKS;
-    buf->f_bfree = sbi->s_nbfree;
-    buf->f_bavail = sbi->s_nbfree;
+    buf->f_bfree = max_t(s64, bfree, 0);
+    buf->f_bavail = buf->f_bfree;
     buf->f_files = SP_MAXFILES;
-    buf->f_ffree = sbi->s_nifree;
+    buf->f_ffree = percpu_counter_read_positive(&sbi->s_nifree);
     buf->f_fsid = u64_to_fsid(huge_encode_dev(sb->s_bdev->bd_dev));
     buf->f_namelen = SP_NAMELEN;
     return 0;
@@ -307,10 +866,28 @@ sp_alloc_inode(struct super_block *sb)
     if (!spi) {
         return NULL;
     }
+    spi->i_next = 0;
+    spi->i_map = NULL;
     printk("spfs: sp_alloc_inode - spi = 0x%px\n", spi);
     return &spi->vfs_inode;
 }
 
+/*
+ * Show the mount options that differ from the defaults in /proc/mounts.
+ */
+
+static int
+sp_show_options(struct seq_file *seq, struct dentry *root)
+{
+    if (sp_test_opt(root->d_sb, DELALLOC)) {
+        seq_puts(seq, ",delalloc");
+    }
+    if (sp_test_opt(root->d_sb, DISCARD)) {
+        seq_puts(seq, ",discard");
+    }
+    return 0;
+}
+
 struct super_operations spfs_sops = {
     .alloc_inode    = sp_alloc_inode,
     .free_inode     = sp_free_inode,
@@ -318,8 +895,62 @@ struct super_operations spfs_sops = {
     .evict_inode    = sp_evict_inode,
     .put_super      = sp_put_super,
     .statfs         = sp_statfs,
+    .show_options   = sp_show_options,
+};
+
+/*
+ * Mount options. "delalloc" turns on delayed allocation of file data
+ * blocks (see sp_iomap_map()). "discard" discards the blocks of 
+ * removed files as they're freed (see sp_free_worker()). Both are off
+ * by default.
+ */
+
+enum {
+    Opt_delalloc, Opt_nodelalloc, Opt_discard, Opt_nodiscard, Opt_err
 };
 
+static const match_table_t sp_tokens = {
+    {Opt_delalloc,      "delalloc"},
+    {Opt_nodelalloc,    "nodelalloc"},
+    {Opt_discard,       "discard"},
+    {Opt_nodiscard,     "nodiscard"},
+    {Opt_err,           NULL}
+};
+
+static int
+sp_parse_options(char *options, struct spfs_sb_info *sbi)
+{
+    substring_t     args[MAX_OPT_ARGS];
+    char            *p;
+
+    if (!options) {
+        return 0;
+    }
+    while ((p = strsep(&options, ",")) != NULL) {
+        if (!*p) {
+            continue;
+        }
+        switch (match_token(p, sp_tokens, args)) {
+        case Opt_delalloc:
+            sbi->s_mount_opt |= SP_MOUNT_DELALLOC;
+            break;
+        case Opt_nodelalloc:
+            sbi->s_mount_opt &= ~SP_MOUNT_DELALLOC;
+            break;
+        case Opt_discard:
+            sbi->s_mount_opt |= SP_MOUNT_DISCARD;
+            break;
+        case Opt_nodiscard:
+            sbi->s_mount_opt &= ~SP_MOUNT_DISCARD;
+            break;
+        default:
+            printk("spfs: Unrecognized mount option \"%s\"\n", p);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
 /*
  * Called from spfs_mount -> mount_bdev(..., spfs_fill_super)
  *
@@ -334,7 +965,7 @@ spfs_fill_super(struct super_block *sb, void *data, int silent)
     struct spfs_sb_info     *spfs_info;
     struct buffer_head      *bh;
     struct inode            *root_inode;
-    int                     i, error;
+    int                     bsize, error = -EINVAL;
 
     printk("spfs: spfs_fill_super entered\n");
 
@@ -347,8 +978,17 @@ spfs_fill_super(struct super_block *sb, void *data, int silent)
     if (!spfs_info) {
         return -ENOMEM;
     }
+    if (sp_parse_options(data, spfs_info)) {
+        kfree(spfs_info);
+        return -EINVAL;
+    }
+    if ((spfs_info->s_mount_opt & SP_MOUNT_DISCARD) &&
+        !bdev_max_discard_sectors(sb->s_bdev)) {
+        printk("spfs: Device does not support discard, ignoring\n");
+        spfs_info->s_mount_opt &= ~SP_MOUNT_DISCARD;
+    }
+    spfs_info->s_sb = sb;
 
-    mutex_init(&spfs_info->s_lock);
     sb_set_blocksize(sb, SP_BSIZE);
     sb->s_time_min = 0;
     sb->s_time_max = U32_MAX;
@@ -356,7 +996,10 @@ spfs_fill_super(struct super_block *sb, void *data, int silent)
     /*
      * Read in block 0 which should contain our superblock. Check
      * to make sure it's got the right magic number and is clean.
-     * We don't yet handle dirty filesystems.
+     * We don't yet handle dirty filesystems. The superblock is at the
+     * start of block 0 whatever the block size, so we read it with 
+     * the smallest size and switch if the filesystem uses bigger 
+     * blocks.
      */
 
     bh = sb_bread(sb, 0);
@@ -374,28 +1017,67 @@ spfs_fill_super(struct super_block *sb, void *data, int silent)
         printk("spfs: Filesystem is not clean. Write and run SPFS fsck!\n");
         goto out1;
     }
+    spfs_info->s_features = le32_to_cpu(spfs_sb->s_features);
+    if (spfs_info->s_features & ~SP_FEATURE_ALL) {
+        printk("spfs: Unsupported features 0x%x\n", 
+               spfs_info->s_features & ~SP_FEATURE_ALL);
+        goto out1;
+    }
+    bsize = le32_to_cpu(spfs_sb->s_bsize);
+    if (bsize == 0) {
+        bsize = SP_BSIZE;
+    }
+    if (bsize < SP_BSIZE || bsize > SP_MAX_BSIZE || !is_power_of_2(bsize)) {
+        printk("spfs: Invalid block size %d\n", bsize);
+        goto out1;
+    }
+    if (bsize != SP_BSIZE) {
+        brelse(bh);
+        if (!sb_set_blocksize(sb, bsize)) {
+            printk("spfs: Can't use %d byte blocks on this device\n", bsize);
+            goto out;
+        }
+        bh = sb_bread(sb, 0);
+        if (!bh) {
+            goto out;
+        }
+        spfs_sb = (struct sp_superblock *)bh->b_data;
+    }
 
     sb->s_fs_info = spfs_info;
     sb->s_magic = SP_MAGIC;
     sb->s_op = &spfs_sops;
-
-    spfs_info->s_nifree = le32_to_cpu(spfs_sb->s_nifree);
-    spfs_info->s_nbfree = le32_to_cpu(spfs_sb->s_nbfree);
-
-
-    for (i=0 ; i<SP_MAXFILES ; i++) {
-        spfs_info->s_inode[i] = le32_to_cpu(spfs_sb->s_inode[i]);
+    sb->s_maxbytes = min_t(loff_t, (loff_t)SP_FILE_BLOCKS(bsize) * bsize,
+                           U32_MAX);        /* i_size is 32 bits on disk */
+
+    error = percpu_counter_init(&spfs_info->s_nifree, 
+                                le32_to_cpu(spfs_sb->s_nifree), GFP_KERNEL);
+    if (!error) {
+        error = percpu_counter_init(&spfs_info->s_nbfree,
+                                    le32_to_cpu(spfs_sb->s_nbfree), GFP_KERNEL);
     }
-    for (i=0 ; i<SP_MAXBLOCKS ; i++) {
-        spfs_info->s_block[i] = le16_to_cpu(spfs_sb->s_block[i]);
+    if (!error) {
+        error = percpu_counter_init(&spfs_info->s_dirtyblocks, 0, GFP_KERNEL);
+    }
+    if (!error) {
+        error = sp_init_alloc(spfs_info);
+    }
+    if (error) {
+        goto out1;
     }
+    spin_lock_init(&spfs_info->s_ioend_lock);
+    INIT_LIST_HEAD(&spfs_info->s_ioend_list);
+    INIT_WORK(&spfs_info->s_ioend_work, sp_ioend_worker);
+    sp_read_imap(spfs_info, spfs_sb);
+    sp_read_bmap(spfs_info, spfs_sb);
 
     /*
      * All superblock handling is done so let's read the root inode.
      */
 
     root_inode = sp_read_inode(sb, SP_ROOT_INO);
-    if (!root_inode) {
+    if (IS_ERR(root_inode)) {
+        error = PTR_ERR(root_inode);
         goto out1;
     }
     printk("spfs: sp_fill_super - root_inode = %px\n", root_inode);
@@ -412,7 +1094,10 @@ out2:
 out1:
     brelse(bh);
 out:
-    mutex_destroy(&spfs_info->s_lock);
+    percpu_counter_destroy(&spfs_info->s_nifree);
+    percpu_counter_destroy(&spfs_info->s_nbfree);
+    percpu_counter_destroy(&spfs_info->s_dirtyblocks);
+    free_percpu(spfs_info->s_hint);
     kfree(spfs_info);
     sb->s_fs_info = NULL;
     return error;
@@ -439,6 +1124,10 @@ sp_init_once(void *ptr)
     struct inode          *inode;
 
     inode_init_once(&spi->vfs_inode);
+    mutex_init(&spi->i_map_lock);
+    spi->i_indbh = NULL;
+    spi->i_dindbh = NULL;
+    spi->i_leafbh = NULL;
     inode = &spi->vfs_inode;
     inode->i_private = spi;
 }
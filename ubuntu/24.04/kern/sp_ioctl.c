@@ -8,8 +8,382 @@
  */
 
 #include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
 #include "spfs.h"
 
+/*
+ * FITRIM (see fstrim(8)). Discard the free blocks in the given range.
+ */
+
+static int
+sp_ioc_trim(struct super_block *sb, void __user *arg)
+{
+	struct fstrim_range		range;
+	int						error;
+
+	if (!bdev_max_discard_sectors(sb->s_bdev)) {
+		return -EOPNOTSUPP;
+	}
+	if (copy_from_user(&range, arg, sizeof(range))) {
+		return -EFAULT;
+	}
+	range.minlen = max_t(u64, range.minlen, 
+						 bdev_discard_granularity(sb->s_bdev));
+	error = sp_trim_fs(sb, &range);
+	if (error) {
+		return error;
+	}
+	if (copy_to_user(arg, &range, sizeof(range))) {
+		return -EFAULT;
+	}
+	return 0;
+}
+
+/*
+ * Count the fragments in a file's block map. Taking the mapped blocks
+ * in file order (skipping holes), a new fragment starts at every block
+ * that isn't physically next to the one before it. "prev" is the last
+ * mapped block seen.
+ */
+
+static void
+sp_count_fragments(int addr, int *prev, int *nfrags)
+{
+	int		blk = sp_addr_block(addr);
+
+	if (blk == 0) {
+		return;
+	}
+	if (blk != *prev + 1) {
+		(*nfrags)++;
+	}
+	*prev = blk;
+}
+
+/*
+ * Carry on counting through the indirect block "blk" ("depth" 1) or 
+ * double indirect block ("depth" 2). Blocks we can't read are skipped.
+ */
+
+static void
+sp_tree_fragments(struct super_block *sb, int blk, int depth, int *prev,
+				  int *nfrags)
+{
+	struct buffer_head		*bh;
+	__le32					*p;
+	int						i;
+
+	if (blk == 0) {
+		return;
+	}
+	bh = sb_bread(sb, blk);
+	if (!bh) {
+		return;
+	}
+	p = (__le32 *)bh->b_data;
+	for (i = 0 ; i < SP_ADDRS_PER_BLOCK(sb->s_blocksize) ; i++) {
+		if (depth > 1) {
+			sp_tree_fragments(sb, le32_to_cpu(p[i]), depth - 1, prev, 
+							  nfrags);
+		} else {
+			sp_count_fragments(le32_to_cpu(p[i]), prev, nfrags);
+		}
+	}
+	brelse(bh);
+}
+
+/*
+ * The fragments in a whole file: the direct blocks in "addr" followed
+ * by whatever the indirect blocks "ind" and "dind" map.
+ */
+
+static int
+sp_map_fragments(struct super_block *sb, const int *addr, int ind, int dind)
+{
+	int		i, prev = 0, nfrags = 0;
+
+	for (i = 0 ; i < SP_DIRECT_BLOCKS ; i++) {
+		sp_count_fragments(addr[i], &prev, &nfrags);
+	}
+	sp_tree_fragments(sb, ind, 1, &prev, &nfrags);
+	sp_tree_fragments(sb, dind, 2, &prev, &nfrags);
+	return nfrags;
+}
+
+/*
+ * Point the block map of a file being defragmented at the blocks in 
+ * "map" for every block that's in use ("oldmap" is the original map).
+ * The inode has a full map array by now so this can't fail.
+ */
+
+static void
+sp_defrag_switch(struct inode *inode, const int *oldmap, const int *map,
+				 int last)
+{
+	struct sp_inode_info	*spi = ITOSPI(inode);
+	int						i;
+
+	mutex_lock(&spi->i_map_lock);
+	for (i = 0 ; i <= last ; i++) {
+		if (oldmap[i]) {
+			sp_dmap_set(spi, i, map[i]);
+		}
+	}
+	mutex_unlock(&spi->i_map_lock);
+}
+
+/*
+ * Dirty the (pinned, uptodate) folios of a file being defragmented
+ * so that writeback writes their data to wherever the block map now
+ * points. Folios with no written blocks have no data to move.
+ */
+
+static void
+sp_defrag_dirty(struct inode *inode, struct folio **folios, int nfolios,
+				const int *map)
+{
+	struct folio			*folio;
+	sector_t				b, end;
+	int						i;
+
+	for (i = 0 ; i < nfolios ; i++) {
+		folio = folios[i];
+		b = folio_pos(folio) >> inode->i_blkbits;
+		end = (folio_pos(folio) + folio_size(folio)) >> inode->i_blkbits;
+		for ( ; b < end && b < SP_DIRECT_BLOCKS ; b++) {
+			if (map[b] > 0) {
+				break;
+			}
+		}
+		if (b == end || b == SP_DIRECT_BLOCKS) {
+			continue;
+		}
+		folio_lock(folio);
+		folio_mark_dirty(folio);
+		folio_unlock(folio);
+	}
+}
+
+/*
+ * SPFS_IOC_DEFRAG. Move the blocks of a file into as few contiguous
+ * runs as we can, which is one run for files of up to a group's worth
+ * of blocks. The file can stay open and in use while we do it.
+ *
+ *  1. Write back the file so there's nothing dirty or delayed.
+ *  2. Allocate the new runs. If that doesn't reduce the number of 
+ *     fragments, stop.
+ *  3. Read in and pin every page of the file so none of them can be 
+ *     dropped and read back from the new blocks before they're written.
+ *  4. Switch the block map over to the new blocks, dirty the pages 
+ *     and write back. That copies the data through the page cache.
+ *  5. Write the inode and free the old blocks.
+ *
+ * Only the direct blocks are moved so files that have indirect blocks
+ * get EOPNOTSUPP rather than being left partly defragmented.
+ *
+ * The inode lock keeps out write(2), truncation and hole punching. If
+ * the data can't be written to the new blocks, the map is pointed 
+ * back at the old ones, which still hold the data, and the new blocks
+ * are freed. The map is held as a full array while it's switched, so
+ * that neither switch can fail, and compacted again at the end.
+ */
+
+static int
+sp_ioc_defrag(struct file *file)
+{
+	struct inode			*inode = file_inode(file);
+	struct super_block		*sb = inode->i_sb;
+	struct address_space	*mapping = inode->i_mapping;
+	struct sp_inode_info	*spi = ITOSPI(inode);
+	struct folio			**folios = NULL;
+	struct folio			*folio;
+	int						*oldmap, *newmap;
+	int						i, k, n, nblocks = 0, last = 0, nfolios = 0;
+	int						blk, want, goal, error;
+	bool					moved = false;
+	pgoff_t					index, end;
+
+	if (!S_ISREG(inode->i_mode)) {
+		return -EINVAL;
+	}
+	oldmap = kcalloc(2 * SP_DIRECT_BLOCKS, sizeof(int), GFP_KERNEL);
+	if (!oldmap) {
+		return -ENOMEM;
+	}
+	newmap = oldmap + SP_DIRECT_BLOCKS;
+
+	inode_lock(inode);
+	inode_dio_wait(inode);
+	error = filemap_write_and_wait(mapping);
+	if (error) {
+		goto out;
+	}
+	mutex_lock(&spi->i_map_lock);
+	if (spi->i_ind || spi->i_dind) {
+		mutex_unlock(&spi->i_map_lock);
+		error = -EOPNOTSUPP;
+		goto out;
+	}
+	for (i = 0 ; i < SP_DIRECT_BLOCKS ; i++) {
+		blk = sp_dmap_get(spi, i);
+		if (sp_addr_block(blk)) {
+			oldmap[i] = blk;
+			nblocks++;
+			last = i;
+		}
+	}
+	mutex_unlock(&spi->i_map_lock);
+	if (sp_map_fragments(sb, oldmap, 0, 0) <= 1) {
+		goto out;
+	}
+
+	/*
+	 * Allocate the new blocks a group's worth at a time, each run 
+	 * following on from the one before if possible.
+	 */
+
+	i = 0;
+	goal = sp_inode_goal(inode);
+	for (n = 0 ; n < nblocks ; n += want) {
+		want = min_t(int, nblocks - n, SP_AG_BLOCKS);
+		blk = sp_block_alloc_exact(sb, goal, want);
+		if (blk == 0) {
+			error = -ENOSPC;
+			goto out_free_new;
+		}
+		for (k = 0 ; k < want ; i++) {
+			if (oldmap[i]) {
+				newmap[i] = (blk + k++) | (oldmap[i] & SP_ADDR_UNWRITTEN);
+			}
+		}
+		goal = blk + want;
+	}
+	if (sp_map_fragments(sb, newmap, 0, 0) >= 
+		sp_map_fragments(sb, oldmap, 0, 0)) {
+		goto out_free_new;
+	}
+
+	end = ((loff_t)last << inode->i_blkbits) >> PAGE_SHIFT;
+	folios = kcalloc(end + 1, sizeof(struct folio *), GFP_KERNEL);
+	if (!folios) {
+		error = -ENOMEM;
+		goto out_free_new;
+	}
+	for (index = 0 ; index <= end ; index = folio->index + folio_nr_pages(folio)) {
+		folio = read_mapping_folio(mapping, index, file);
+		if (IS_ERR(folio)) {
+			error = PTR_ERR(folio);
+			goto out_put;
+		}
+		folios[nfolios++] = folio;
+	}
+
+	mutex_lock(&spi->i_map_lock);
+	error = sp_dmap_expand(spi);
+	mutex_unlock(&spi->i_map_lock);
+	if (error) {
+		goto out_put;
+	}
+	sp_defrag_switch(inode, oldmap, newmap, last);
+	sp_defrag_dirty(inode, folios, nfolios, newmap);
+	error = filemap_write_and_wait(mapping);
+	if (error) {
+		sp_defrag_switch(inode, oldmap, oldmap, last);
+		goto out_put;
+	}
+	mark_inode_dirty(inode);
+	error = sync_inode_metadata(inode, 1);
+	sp_free_blocks_deferred(sb, oldmap, 0, 0);
+	moved = true;
+
+out_put:
+	mutex_lock(&spi->i_map_lock);
+	sp_dmap_compact(spi);
+	mutex_unlock(&spi->i_map_lock);
+	for (i = 0 ; i < nfolios ; i++) {
+		folio_put(folios[i]);
+	}
+	kfree(folios);
+out_free_new:
+	if (!moved) {
+		sp_free_blocks_deferred(sb, newmap, 0, 0);
+	}
+out:
+	inode_unlock(inode);
+	kfree(oldmap);
+	return error;
+}
+
+/*
+ * SPFS_IOC_FREESPACE. Report how fragmented the free space and the 
+ * files are (see struct sp_freespace). Files that are in core may have
+ * changes that aren't on disk yet so we use their in-core block map. 
+ * For the rest we read the inode straight from disk rather than 
+ * bringing it in core.
+ */
+
+static int
+sp_ioc_freespace(struct super_block *sb, void __user *arg)
+{
+	struct spfs_sb_info		*sbi = SBTOSPFSSB(sb);
+	struct sp_freespace		*fs;
+	struct sp_inode_info	*spi;
+	struct sp_inode			*dip;
+	struct buffer_head		*bh;
+	struct inode			*inode;
+	int						*addr;
+	int						ino, error = 0;
+
+	fs = kzalloc(sizeof(struct sp_freespace), GFP_KERNEL);
+	addr = kmalloc_array(SP_DIRECT_BLOCKS, sizeof(int), GFP_KERNEL);
+	if (!fs || !addr) {
+		kfree(fs);
+		kfree(addr);
+		return -ENOMEM;
+	}
+	sp_free_extents(sbi, fs);
+	for (ino = SP_ROOT_INO ; ino < SP_MAXFILES ; ino++) {
+		if (!test_bit(ino, sbi->s_imap)) {
+			continue;
+		}
+		inode = ilookup(sb, ino);
+		if (inode) {
+			spi = ITOSPI(inode);
+			if (!S_ISLNK(inode->i_mode)) {
+				mutex_lock(&spi->i_map_lock);
+				sp_dmap_copy(spi, addr);
+				fs->fs_frags[ino] = sp_map_fragments(sb, addr, spi->i_ind,
+													 spi->i_dind);
+				mutex_unlock(&spi->i_map_lock);
+			}
+			iput(inode);
+			continue;
+		}
+		bh = sb_bread(sb, SP_INODE_BLOCK + ino);
+		if (!bh) {
+			continue;
+		}
+		dip = (struct sp_inode *)bh->b_data;
+		if (!S_ISLNK(le32_to_cpu(dip->i_mode))) {
+			sp_read_map(dip, addr);
+			fs->fs_frags[ino] = sp_map_fragments(sb, addr, 
+									le32_to_cpu(dip->i_ind),
+									le32_to_cpu(dip->i_dind));
+		}
+		brelse(bh);
+	}
+	if (copy_to_user(arg, fs, sizeof(struct sp_freespace))) {
+		error = -EFAULT;
+	}
+	kfree(fs);
+	kfree(addr);
+	return error;
+}
+
 long
 sp_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
@@ -23,12 +397,18 @@ sp_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	switch (cmd) {
 		case SPFS_SB:
 			printk("SPFS superblock at %p\n", sbi);
-			printk("s_nifree = %lu\n", sbi->s_nifree);
-			printk("s_nbfree = %lu\n", sbi->s_nbfree);
+			printk("s_nifree = %lld\n", percpu_counter_sum(&sbi->s_nifree));
+			printk("s_nbfree = %lld\n", percpu_counter_sum(&sbi->s_nbfree));
 			break;
 		case SPFS_INODE:
 			printk("SPFS inode %p\n", spi);
 			break;
+		case FITRIM:
+			return sp_ioc_trim(inode->i_sb, (void __user *)arg);
+		case SPFS_IOC_DEFRAG:
+			return sp_ioc_defrag(file);
+		case SPFS_IOC_FREESPACE:
+			return sp_ioc_freespace(inode->i_sb, (void __user *)arg);
 		default:
 			printk("spfs - invalid ioctl (%d)\n", cmd);
 	}
@@ -7,20 +7,32 @@
  */
 
 #define SP_BSIZE                2048
+#define SP_MAX_BSIZE            65536
 #define SP_MAXFILES             128
 #define SP_MAXBLOCKS            760
 #define SP_NAMELEN              28        
 #define SP_DIRENT_SIZE 			32        
-#define SP_DIRS_PER_BLOCK       64
+#define SP_DIRS_PER_BLOCK(bs)   ((bs) / SP_DIRENT_SIZE)
 #define SP_DIRECT_BLOCKS        247
 #define SP_FIRST_DATA_BLOCK     129
 #define SP_MAGIC                0x53504653
 #define SP_INODE_BLOCK          1
 #define SP_ROOT_INO             2
+#define SP_DATA_BLOCKS          (SP_MAXBLOCKS - SP_FIRST_DATA_BLOCK)
+#define SP_BMAP_WORDS           ((SP_DATA_BLOCKS + 31) / 32)
 
 /*
  * The on-disk superblock. The number of inodes and 
- * data blocks is fixed.
+ * data blocks is fixed. Data blocks are tracked with a bitmap,
+ * one bit per block. Bit 0 of s_bmap[0] is SP_FIRST_DATA_BLOCK,
+ * bit 1 is SP_FIRST_DATA_BLOCK + 1 and so on. A set bit means
+ * the block is in use. s_features holds optional format features 
+ * chosen at mkfs time.
+ *
+ * s_bsize is the block size, a power of two from SP_BSIZE to 
+ * SP_MAX_BSIZE chosen at mkfs time (0 means SP_BSIZE). The layout 
+ * is the same whatever the size, counted in blocks. The superblock
+ * is always at the start of block 0.
  */
 
 struct sp_superblock {
@@ -29,11 +41,38 @@ struct sp_superblock {
 	__u32	s_nifree;
 	__u32	s_inode[SP_MAXFILES];
 	__u32	s_nbfree;
-	__u16	s_block[SP_MAXBLOCKS];
+	__u32	s_bmap[SP_BMAP_WORDS];
+	__u32	s_features;
+	__u32	s_bsize;
+};
+
+#define SP_FEATURE_EXTENTS      0x0001    /* inodes may use extents */
+#define SP_FEATURE_ALL          (SP_FEATURE_EXTENTS)
+
+/*
+ * An extent maps "e_len" logical blocks starting at "e_lblk" onto
+ * contiguous disk blocks starting at "e_pblk". SP_ADDR_UNWRITTEN may
+ * be set in e_pblk.
+ */
+
+struct sp_extent {
+	__u32	e_lblk;
+	__u32	e_len;
+	__u32	e_pblk;
 };
 
+#define SP_MAX_EXTENTS          ((SP_DIRECT_BLOCKS * 4) / 12)
+
 /*
- * The on-disk inode.
+ * The on-disk inode. The block map is either SP_DIRECT_BLOCKS direct
+ * block addresses or, if SP_INODE_EXTENTS is set in i_flags, up to 
+ * SP_MAX_EXTENTS extents sorted by e_lblk. A zero e_len ends the list.
+ *
+ * Blocks beyond the direct map are reached through i_ind, a block of
+ * SP_ADDRS_PER_BLOCK addresses, and then i_dind, a block of addresses
+ * of such blocks. Entries in indirect blocks are in the same form as
+ * i_addr[] entries. How many blocks they map depends on the block 
+ * size "bs".
  */
 
 struct sp_inode {
@@ -46,9 +85,32 @@ struct sp_inode {
 	__u32	i_gid;
 	__u32	i_size;
 	__u32	i_blocks;
-	__u32	i_addr[SP_DIRECT_BLOCKS];
+	union {
+		__u32				i_addr[SP_DIRECT_BLOCKS];
+		struct sp_extent	i_extent[SP_MAX_EXTENTS];
+	};
+	__u32	i_flags;
+	__u32	i_ind;
+	__u32	i_dind;
 };
 
+#define SP_INODE_EXTENTS        0x0001    /* block map is extents */
+
+#define SP_ADDRS_PER_BLOCK(bs)  ((bs) / sizeof(__u32))
+#define SP_IND_BLOCKS(bs)       SP_ADDRS_PER_BLOCK(bs)
+#define SP_DIND_BLOCKS(bs)      (SP_ADDRS_PER_BLOCK(bs) * SP_ADDRS_PER_BLOCK(bs))
+#define SP_FILE_BLOCKS(bs)      (SP_DIRECT_BLOCKS + SP_IND_BLOCKS(bs) + \
+                                 SP_DIND_BLOCKS(bs))
+
+/*
+ * The top bit of an i_addr[] entry marks a block that has been 
+ * allocated by fallocate(2) but never written. Reads of it return 
+ * zeros without going to disk.
+ */
+
+#define SP_ADDR_UNWRITTEN       0x80000000
+#define SP_ADDR_BLOCK(a)        ((a) & ~SP_ADDR_UNWRITTEN)
+
 /*
  * Allocation flags
  */
@@ -74,34 +136,188 @@ struct sp_dirent {
         char        d_name[SP_NAMELEN];
 };
 
+/*
+ * Free space report returned by the SPFS_IOC_FREESPACE ioctl (fsdb's
+ * "sf" command prints the same thing). fs_hist[n] counts the free 
+ * extents of 2^n to 2^(n+1) - 1 blocks with the last bucket taking
+ * everything bigger. fs_frags[] holds the number of fragments in each
+ * file (0 for free inodes and symlinks).
+ */
+
+#define SP_FS_HIST        10
+
+struct sp_freespace {
+	__u32	fs_nbfree;
+	__u32	fs_nextents;
+	__u32	fs_largest;
+	__u32	fs_hist[SP_FS_HIST];
+	__u32	fs_frags[SP_MAXFILES];
+};
+
 #ifdef __KERNEL__
 
 /*
- * In-core SPFS superblock
+ * In-core allocation group. The data blocks are split into groups of
+ * SP_AG_BLOCKS blocks. Each group has its own free count and bitmap
+ * (one bit per block, searched a word at a time). Blocks are claimed
+ * and released with atomic bit operations so no lock is needed.
+ */
+
+#define SP_AG_BLOCKS            128
+#define SP_NR_AGS               DIV_ROUND_UP(SP_DATA_BLOCKS, SP_AG_BLOCKS)
+
+struct sp_agroup {
+	unsigned int	ag_first;		/* first data block in the group */
+	unsigned int	ag_nblocks;		/* number of blocks in the group */
+	atomic_t		ag_nfree;		/* number of free blocks */
+	DECLARE_BITMAP(ag_bmap, SP_AG_BLOCKS);
+};
+
+/*
+ * Inodes are split into groups of SP_IG_INODES. Inode group "n" keeps 
+ * its file data in allocation group (n % SP_NR_AGS). New inodes are 
+ * placed near their parent directory so a directory's inodes sit in
+ * consecutive blocks of the inode table.
+ */
+
+#define SP_IG_INODES            16
+#define SP_NR_IGS               (SP_MAXFILES / SP_IG_INODES)
+
+/*
+ * Per-CPU allocation hint. Each CPU starts searching where it last
+ * allocated so CPUs allocating at the same time tend to look at 
+ * different words of the block bitmaps.
+ */
+
+struct sp_alloc_hint {
+	unsigned int	ah_block;		/* next data block to try */
+};
+
+/*
+ * Mount options (s_mount_opt)
+ */
+
+#define SP_MOUNT_DELALLOC       0x0001    /* delay block allocation */
+#define SP_MOUNT_DISCARD        0x0002    /* discard blocks when freed */
+
+#define sp_test_opt(sb, opt)    \
+        (((struct spfs_sb_info *)(sb)->s_fs_info)->s_mount_opt & SP_MOUNT_##opt)
+
+/*
+ * In-core SPFS superblock. The free inode and block counts are per-CPU 
+ * counters so that statfs and the "out of space" checks never need a 
+ * lock. The inode map is a bitmap updated with atomic bit operations.
+ * s_dirtyblocks counts blocks reserved by delayed allocation that have
+ * not been allocated yet. They can't be handed out to anyone else.
  */
 
 struct spfs_sb_info {
-	unsigned long  	s_nifree;
-	unsigned long  	s_inode[SP_MAXFILES];
-	unsigned long  	s_nbfree;
-	unsigned long  	s_block[SP_MAXBLOCKS];
-	struct mutex 	s_lock;
+	struct super_block		*s_sb;
+	struct percpu_counter	s_nifree;
+	DECLARE_BITMAP(s_imap, SP_MAXFILES);
+	atomic_t				s_ig_nfree[SP_NR_IGS];
+	struct percpu_counter	s_nbfree;
+	struct percpu_counter	s_dirtyblocks;
+	struct sp_agroup		s_ag[SP_NR_AGS];
+	struct sp_alloc_hint __percpu *s_hint;
+	unsigned int			s_mount_opt;
+	unsigned int			s_features;		/* SP_FEATURE_* from disk */
+	spinlock_t				s_free_lock;	/* protects s_free_list */
+	struct list_head		s_free_list;	/* sp_free_req's to process */
+	struct work_struct		s_free_work;
+	spinlock_t				s_ioend_lock;	/* protects s_ioend_list */
+	struct list_head		s_ioend_list;	/* written unwritten ioends */
+	struct work_struct		s_ioend_work;
+};
+
+/*
+ * The blocks of a removed file are freed in the background by 
+ * sp_free_worker(). Each removed file queues a copy of its direct
+ * block map and its indirect blocks, which are read by the worker.
+ */
+
+struct sp_free_req {
+	struct list_head		fr_list;
+	int						fr_addr[SP_DIRECT_BLOCKS];
+	int						fr_ind;
+	int						fr_dind;
 };
 
 /*
- * In-core SPFS inode
+ * In-core direct block map. Most files are a few contiguous runs so 
+ * the map is held as up to SP_INLINE_EXTENTS extents, sorted by 
+ * e_lblk, in the inode itself. An extent maps "e_len" blocks from 
+ * "e_lblk" and "e_addr" is the map entry for e_lblk. The entries that
+ * follow are e_addr + 1, e_addr + 2 and so on, except for delayed 
+ * allocations which are all SP_DELALLOC_ADDR. A file too fragmented 
+ * for that gets a full SP_DIRECT_BLOCKS entry array (i_map) instead.
+ * Use sp_dmap_get() and sp_dmap_set() rather than looking at either.
  */
 
+#define SP_INLINE_EXTENTS       4
+
+struct sp_iext {
+	int				e_lblk;
+	int				e_len;
+	int				e_addr;
+};
+
+/*
+ * In-core SPFS inode. With delayed allocation a direct map entry of
+ * SP_DELALLOC_ADDR means that the block has been written to and space
+ * has been reserved for it but no disk block has been allocated yet.
+ * It is never written to disk, so only direct blocks are delayed.
+ * Symlinks have no blocks so keep their target where the map would be.
+ *
+ * The indirect blocks of a file are kept in the buffer cache and we
+ * hold on to the last ones used (i_indbh, i_dindbh and the leaf of 
+ * i_dind in i_leafbh) so that walking through a file doesn't have to 
+ * look them up for every block. i_map_lock serializes changes to the
+ * block map, including the indirect blocks, and protects the cache.
+ */
+
+#define SP_DELALLOC_ADDR        (-1)
+
 struct sp_inode_info {
     char            i_fs[4];
 	int				i_blocks;
-	int				i_addr[SP_DIRECT_BLOCKS];
-	char			i_symlink[SP_NAMELEN];
+	int				i_next;			/* extents in use in i_ext[] */
+	int				*i_map;			/* full direct map, or NULL */
+	union {
+		struct sp_iext	i_ext[SP_INLINE_EXTENTS];
+		char			i_symlink[SP_NAMELEN];
+	};
+	int				i_ind;			/* indirect block */
+	int				i_dind;			/* double indirect block */
+	struct buffer_head	*i_indbh;	/* cached i_ind */
+	struct buffer_head	*i_dindbh;	/* cached i_dind */
+	struct buffer_head	*i_leafbh;	/* cached leaf of i_dind */
+	int				i_leaf;			/* which leaf i_leafbh is */
+	struct mutex	i_map_lock;
     struct inode	vfs_inode;  
 };
 
-#define	SPFS_SB		0x0001
-#define	SPFS_INODE	0x0002
+/*
+ * A map entry is a hole (0), a delayed allocation, a written
+ * block (> 0) or an unwritten block (SP_ADDR_UNWRITTEN set). These
+ * return whether the block is unwritten and the disk block backing 
+ * an entry (written or not) or 0 if there isn't one.
+ */
+
+static inline bool sp_addr_unwritten(int addr)
+{
+    return addr != SP_DELALLOC_ADDR && (addr & SP_ADDR_UNWRITTEN);
+}
+
+static inline int sp_addr_block(int addr)
+{
+    return (addr == SP_DELALLOC_ADDR) ? 0 : (int)SP_ADDR_BLOCK(addr);
+}
+
+#define	SPFS_SB			0x0001
+#define	SPFS_INODE		0x0002
+#define	SPFS_IOC_DEFRAG	0x0003	/* make the file contiguous */
+#define	SPFS_IOC_FREESPACE	0x0004	/* struct sp_freespace */
 
 #define SBTOSPFSSB(sb)	(struct spfs_sb_info *)sb->s_fs_info
 #define ITOSPI(inode)   (struct sp_inode_info *)inode->i_private
@@ -126,8 +342,30 @@ static const struct inode_operations sp_symlink_operations;
  * Functions from sp_alloc.c
  */
 
-extern ino_t sp_ialloc(struct super_block *);
-extern int sp_block_alloc(struct super_block *sb);
+extern ino_t sp_ialloc(struct super_block *sb, struct inode *dip, umode_t mode);
+extern void sp_ifree(struct super_block *sb, ino_t ino);
+extern int sp_block_alloc_range(struct super_block *sb, int goal,
+                                unsigned int *count);
+extern int sp_block_alloc_reserved(struct super_block *sb, int goal,
+                                   unsigned int *count);
+extern int sp_block_alloc(struct super_block *sb, int goal);
+extern int sp_block_alloc_exact(struct super_block *sb, int goal, 
+                                unsigned int count);
+extern void sp_block_free(struct super_block *sb, int blk, unsigned int count);
+extern void sp_free_blocks_deferred(struct super_block *sb, int *addr,
+                                    int ind, int dind);
+extern void sp_free_inode_blocks(struct inode *inode);
+extern bool sp_flush_frees(struct spfs_sb_info *sbi);
+extern int sp_reserve_blocks(struct super_block *sb, unsigned int count);
+extern void sp_release_blocks(struct super_block *sb, unsigned int count);
+extern int sp_inode_goal(struct inode *inode);
+extern int sp_init_alloc(struct spfs_sb_info *sbi);
+extern int sp_trim_fs(struct super_block *sb, struct fstrim_range *range);
+extern void sp_free_extents(struct spfs_sb_info *sbi, struct sp_freespace *fs);
+extern void sp_read_imap(struct spfs_sb_info *sbi, struct sp_superblock *dsb);
+extern void sp_write_imap(struct spfs_sb_info *sbi, struct sp_superblock *dsb);
+extern void sp_read_bmap(struct spfs_sb_info *sbi, struct sp_superblock *dsb);
+extern void sp_write_bmap(struct spfs_sb_info *sbi, struct sp_superblock *dsb);
 
 /*
  * Functions from sp_dir.c
@@ -168,6 +406,16 @@ extern int sp_unlink(struct inode *dip, struct dentry *dentry);
 extern int sp_find_entry(struct inode *, char *);
 extern int sp_unlink(struct inode *, struct dentry *);
 extern int sp_link(struct dentry *, struct inode *, struct dentry *);
+extern void sp_read_map(struct sp_inode *dip, int *addr);
+extern int sp_dmap_get(struct sp_inode_info *spi, int block);
+extern int sp_dmap_set(struct sp_inode_info *spi, int block, int addr);
+extern void sp_dmap_copy(struct sp_inode_info *spi, int *addr);
+extern int sp_dmap_expand(struct sp_inode_info *spi);
+extern void sp_dmap_compact(struct sp_inode_info *spi);
+extern int sp_map_read(struct inode *inode, sector_t block, int *addr);
+extern int sp_map_set(struct inode *inode, sector_t block, int addr, 
+                      int goal);
+extern void sp_map_release(struct sp_inode_info *spi);
 extern struct inode *sp_read_inode(struct super_block *sb, unsigned long ino);
 extern int sp_write_inode(struct inode *inode, struct writeback_control *wbc);
 extern void sp_free_inode(struct inode *inode);
@@ -185,19 +433,8 @@ extern struct dentry *spfs_mount(struct file_system_type *fs_type, int flags,
  * Functions from sp_file.c	
  */
 
-extern int sp_get_block(struct inode *inode, sector_t block,
-                        struct buffer_head *bh_result, int create);
-extern void sp_write_failed(struct address_space *mapping, loff_t to);
-extern int sp_write_begin(struct file *file, 
-                                 struct address_space *mapping, loff_t pos, 
-                                 unsigned len, struct page **pagep, 
-                                 void **fsdata);
-extern int sp_write_end(struct file *file, struct address_space *mapping,
-                               loff_t pos, unsigned len, unsigned copied,
-                               struct page *page, void *fsdata);
-extern int sp_writepage(struct page *page, struct writeback_control *wbc);
-extern int sp_read_folio(struct file *file, struct folio *folio);
-extern sector_t sp_bmap(struct address_space *mapping, sector_t block);
+extern const struct iomap_ops sp_iomap_ops;
+extern void sp_ioend_worker(struct work_struct *work);
 extern void sp_init_once(void *ptr);
 extern int __init sp_init_inodecache(void);
 extern void sp_destroy_inodecache(void);